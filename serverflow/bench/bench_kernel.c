@@ -0,0 +1,469 @@
+/* Microbenchmarks for msgqueue, spscring and thrdpool.
+ *
+ *   cmake -S . -B build && cmake --build build --target bench_kernel
+ *   build/serverflow/bench/bench_kernel [-n count] [-t threads]
+ *       [-d deque_size] [-s spin]
+ *
+ * Configured with -DSERVERFLOW_TRACE=ON, the run leaves a Chrome trace
+ * of the last events of every thread in bench_kernel.json.
+ *
+ * msgqueue rows report throughput and put-to-get latency percentiles
+ * for each producer/consumer mix, bounded and unbounded, on both
+ * backends; the spscring row is the 1:1 bounded case for comparison.
+ * thrdpool rows report the cost of a schedule call as seen by
+ * the caller and the end-to-end task rate. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "msgqueue.h"
+#include "spscring.h"
+#include "trace.h"
+#include "thrdpool.h"
+
+#define BENCH_HIST 64
+
+struct bench_msg
+{
+    void* link;
+    unsigned long long stamp;
+};
+
+struct bench_queue
+{
+    msgqueue_t* queue;
+    struct bench_msg* msgs;
+    size_t per_producer;
+    size_t total;
+    size_t consumed;
+    pthread_mutex_t mutex;
+    unsigned long long hist[BENCH_HIST];
+};
+
+struct bench_producer
+{
+    struct bench_queue* bq;
+    size_t index;
+};
+
+static size_t bench_count = 1000000;
+static size_t bench_threads = 4;
+static size_t bench_deque = 0;
+static int bench_spin = 0;
+
+static unsigned long long bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// log2 buckets; the percentile is reported as the bucket's upper bound.
+static int bench_bucket(unsigned long long v)
+{
+    return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static unsigned long long bench_percentile(
+    const unsigned long long* hist, double q)
+{
+    unsigned long long total = 0;
+    unsigned long long sum = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST; i++)
+        total += hist[i];
+
+    for (i = 0; i < BENCH_HIST; i++)
+    {
+        sum += hist[i];
+        if (sum > 0 && sum >= q * total)
+            break;
+    }
+
+    return i ? 1ULL << i : 0;
+}
+
+static void* bench_produce(void* arg)
+{
+    struct bench_producer* p = (struct bench_producer*)arg;
+    struct bench_queue* bq = p->bq;
+    struct bench_msg* msg = bq->msgs + p->index * bq->per_producer;
+    size_t i;
+
+    for (i = 0; i < bq->per_producer; i++, msg++)
+    {
+        msg->stamp = bench_now();
+        msgqueue_put(msg, bq->queue);
+    }
+
+    return NULL;
+}
+
+static void* bench_consume(void* arg)
+{
+    struct bench_queue* bq = (struct bench_queue*)arg;
+    unsigned long long hist[BENCH_HIST] = {0};
+    struct bench_msg* msg;
+    size_t n = 0;
+    int i;
+
+    while ((msg = (struct bench_msg*)msgqueue_get(bq->queue)) != NULL)
+    {
+        hist[bench_bucket(bench_now() - msg->stamp)]++;
+        if (__atomic_add_fetch(&bq->consumed, 1, __ATOMIC_RELAXED) ==
+            bq->total)
+        {
+            // Let the other consumers out.
+            msgqueue_set_nonblock(bq->queue);
+        }
+
+        n++;
+    }
+
+    pthread_mutex_lock(&bq->mutex);
+    for (i = 0; i < BENCH_HIST; i++)
+        bq->hist[i] += hist[i];
+
+    pthread_mutex_unlock(&bq->mutex);
+    return NULL;
+}
+
+static void bench_msgqueue(
+    size_t producers, size_t consumers, size_t maxlen, int flags)
+{
+    struct bench_producer* prod;
+    struct bench_queue bq;
+    pthread_t* tids;
+    unsigned long long start;
+    double secs;
+    size_t i;
+
+    memset(&bq, 0, sizeof(bq));
+    bq.per_producer = bench_count / producers;
+    bq.total = bq.per_producer * producers;
+    bq.queue = msgqueue_create_ex(maxlen, 0, flags);
+    bq.msgs = (struct bench_msg*)malloc(bq.total * sizeof(struct bench_msg));
+    prod = (struct bench_producer*)malloc(
+        producers * sizeof(struct bench_producer));
+    tids = (pthread_t*)malloc((producers + consumers) * sizeof(pthread_t));
+    if (!bq.queue || !bq.msgs || !prod || !tids)
+    {
+        perror("bench_msgqueue");
+        exit(1);
+    }
+
+    pthread_mutex_init(&bq.mutex, NULL);
+    msgqueue_set_spin(bq.queue, bench_spin);
+    start = bench_now();
+    for (i = 0; i < consumers; i++)
+        pthread_create(&tids[i], NULL, bench_consume, &bq);
+
+    for (i = 0; i < producers; i++)
+    {
+        prod[i].bq = &bq;
+        prod[i].index = i;
+        pthread_create(&tids[consumers + i], NULL, bench_produce, &prod[i]);
+    }
+
+    for (i = 0; i < producers + consumers; i++)
+        pthread_join(tids[i], NULL);
+
+    secs = (bench_now() - start) / 1e9;
+    printf("msgqueue %-8s P=%zu C=%zu maxlen=%-6zu %10.0f msg/s"
+           "  p50=%lluns p99=%lluns\n",
+           flags & MSGQUEUE_LOCKFREE ? "lockfree" : "locked", producers,
+           consumers, maxlen, bq.total / secs, bench_percentile(bq.hist, 0.5),
+           bench_percentile(bq.hist, 0.99));
+
+    pthread_mutex_destroy(&bq.mutex);
+    msgqueue_destory(bq.queue);
+    free(tids);
+    free(prod);
+    free(bq.msgs);
+}
+
+struct bench_ring
+{
+    spscring_t* ring;
+    struct bench_msg* msgs;
+    size_t total;
+};
+
+static void* bench_ring_produce(void* arg)
+{
+    struct bench_ring* br = (struct bench_ring*)arg;
+    size_t i;
+
+    for (i = 0; i < br->total; i++)
+    {
+        br->msgs[i].stamp = bench_now();
+        spscring_put(&br->msgs[i], br->ring);
+    }
+
+    return NULL;
+}
+
+static void bench_spscring(size_t capacity)
+{
+    unsigned long long hist[BENCH_HIST] = {0};
+    unsigned long long start;
+    struct bench_ring br;
+    struct bench_msg* msg;
+    pthread_t tid;
+    double secs;
+    size_t i;
+
+    br.total = bench_count;
+    br.ring = spscring_create(capacity);
+    br.msgs = (struct bench_msg*)malloc(br.total * sizeof(struct bench_msg));
+    if (!br.ring || !br.msgs)
+    {
+        perror("bench_spscring");
+        exit(1);
+    }
+
+    spscring_set_spin(br.ring, bench_spin);
+    start = bench_now();
+    pthread_create(&tid, NULL, bench_ring_produce, &br);
+    for (i = 0; i < br.total; i++)
+    {
+        msg = (struct bench_msg*)spscring_get(br.ring);
+        hist[bench_bucket(bench_now() - msg->stamp)]++;
+    }
+
+    pthread_join(tid, NULL);
+    secs = (bench_now() - start) / 1e9;
+    printf("spscring          P=1 C=1 maxlen=%-6zu %10.0f msg/s"
+           "  p50=%lluns p99=%lluns\n",
+           capacity, br.total / secs, bench_percentile(hist, 0.5),
+           bench_percentile(hist, 0.99));
+
+    spscring_destory(br.ring);
+    free(br.msgs);
+}
+
+struct bench_pool
+{
+    thrdpool_t* pool;
+    size_t done;
+    size_t total;
+    int spin_work;
+};
+
+static void bench_task(void* context)
+{
+    struct bench_pool* bp = (struct bench_pool*)context;
+    volatile int x = 0;
+    int i;
+
+    for (i = 0; i < bp->spin_work; i++)
+        x += i;
+
+    __atomic_fetch_add(&bp->done, 1, __ATOMIC_RELAXED);
+}
+
+struct bench_chain
+{
+    struct bench_pool* bp;
+    size_t left;
+};
+
+// Each link schedules the next one from inside the pool.
+static void bench_chain_task(void* context)
+{
+    struct bench_chain* chain = (struct bench_chain*)context;
+    struct thrdpool_task task = {
+        .routine = bench_chain_task,
+        .context = chain,
+    };
+
+    __atomic_fetch_add(&chain->bp->done, 1, __ATOMIC_RELAXED);
+    if (--chain->left > 0)
+        thrdpool_schedule(&task, chain->bp->pool);
+}
+
+static thrdpool_t* bench_pool_create(void)
+{
+    struct thrdpool_params params = THRDPOOL_PARAMS_DEFAULT;
+    thrdpool_t* pool;
+
+    params.nthreads = bench_threads;
+    params.deque_size = bench_deque;
+    params.spin = bench_spin;
+    pool = thrdpool_create_ex(&params);
+    if (!pool)
+    {
+        perror("thrdpool_create_ex");
+        exit(1);
+    }
+
+    return pool;
+}
+
+static void bench_wait(struct bench_pool* bp)
+{
+    while (__atomic_load_n(&bp->done, __ATOMIC_RELAXED) < bp->total)
+        usleep(100);
+}
+
+static void bench_print(const char* name, size_t n, unsigned long long start,
+                        unsigned long long queued)
+{
+    double secs = (bench_now() - start) / 1e9;
+
+    printf("thrdpool %-14s T=%zu %8.1f ns/schedule %10.0f task/s\n", name,
+           bench_threads, (double)(queued - start) / n, n / secs);
+}
+
+static void bench_thrdpool(const char* name, int spin_work)
+{
+    struct thrdpool_task task = {.routine = bench_task, .context = NULL};
+    struct bench_pool bp;
+    unsigned long long start;
+    unsigned long long queued;
+    size_t i;
+
+    memset(&bp, 0, sizeof(bp));
+    bp.pool = bench_pool_create();
+    bp.total = bench_count;
+    bp.spin_work = spin_work;
+    task.context = &bp;
+    start = bench_now();
+    for (i = 0; i < bp.total; i++)
+        thrdpool_schedule(&task, bp.pool);
+
+    queued = bench_now();
+    bench_wait(&bp);
+    bench_print(name, bp.total, start, queued);
+    thrdpool_destory(NULL, bp.pool);
+}
+
+static void bench_thrdpool_batch(void)
+{
+    struct thrdpool_task tasks[64];
+    struct bench_pool bp;
+    unsigned long long start;
+    unsigned long long queued;
+    size_t i;
+
+    memset(&bp, 0, sizeof(bp));
+    bp.pool = bench_pool_create();
+    bp.total = bench_count / 64 * 64;
+    for (i = 0; i < 64; i++)
+    {
+        tasks[i].routine = bench_task;
+        tasks[i].context = &bp;
+    }
+
+    start = bench_now();
+    for (i = 0; i < bp.total; i += 64)
+        thrdpool_schedule_batch(tasks, 64, bp.pool);
+
+    queued = bench_now();
+    bench_wait(&bp);
+    bench_print("batch64", bp.total, start, queued);
+    thrdpool_destory(NULL, bp.pool);
+}
+
+static void bench_thrdpool_chain(void)
+{
+    size_t nchains = bench_threads * 4;
+    struct bench_chain* chains;
+    struct thrdpool_task task;
+    struct bench_pool bp;
+    unsigned long long start;
+    size_t i;
+
+    if (nchains > bench_count)
+        nchains = bench_count;
+
+    chains = (struct bench_chain*)malloc(nchains * sizeof(*chains));
+    if (!chains)
+    {
+        perror("bench_thrdpool_chain");
+        exit(1);
+    }
+
+    memset(&bp, 0, sizeof(bp));
+    bp.pool = bench_pool_create();
+    bp.total = bench_count / nchains * nchains;
+    task.routine = bench_chain_task;
+    start = bench_now();
+    for (i = 0; i < nchains; i++)
+    {
+        chains[i].bp = &bp;
+        chains[i].left = bp.total / nchains;
+        task.context = &chains[i];
+        thrdpool_schedule(&task, bp.pool);
+    }
+
+    bench_wait(&bp);
+    bench_print("chained", bp.total, start, start);
+    thrdpool_destory(NULL, bp.pool);
+    free(chains);
+}
+
+int main(int argc, char* argv[])
+{
+    static const size_t mixes[][2] = {{1, 1}, {1, 4}, {4, 1}, {4, 4}};
+    static const size_t maxlens[] = {0, 1024};
+    size_t i;
+    size_t j;
+    int flags;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:t:d:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            bench_count = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            bench_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            bench_deque = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            bench_spin = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-n count] [-t threads] [-d deque_size] "
+                    "[-s spin]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_count < 64 || bench_threads == 0)
+    {
+        fprintf(stderr, "need -n >= 64 and -t >= 1\n");
+        return 1;
+    }
+
+    for (flags = 0; flags <= MSGQUEUE_LOCKFREE; flags += MSGQUEUE_LOCKFREE)
+    {
+        for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+        {
+            for (j = 0; j < sizeof(maxlens) / sizeof(maxlens[0]); j++)
+                bench_msgqueue(mixes[i][0], mixes[i][1], maxlens[j], flags);
+        }
+    }
+
+    bench_spscring(1024);
+    bench_thrdpool("empty", 0);
+    bench_thrdpool("tiny", 100);
+    bench_thrdpool_batch();
+    bench_thrdpool_chain();
+#ifdef SERVERFLOW_TRACE
+    if (trace_export("bench_kernel.json") < 0)
+        perror("trace_export");
+#endif
+    return 0;
+}
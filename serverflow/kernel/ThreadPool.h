@@ -0,0 +1,408 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+/* C++20 coroutine layer over thrdpool. co_await pool.schedule() moves the
+ * rest of a coroutine onto a pool worker: the coroutine handle itself is
+ * the task context, queued on an entry that lives in the awaiter, so the
+ * hop allocates nothing. Task<T> is a lazy coroutine result whose frames
+ * come from a per-thread recycler. */
+
+#include <condition_variable>
+#include <coroutine>
+#include <cerrno>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <system_error>
+#include <utility>
+#include "thrdpool.h"
+
+namespace serverflow
+{
+
+/* Free lists of coroutine frames, per thread and in 64-byte size classes.
+ * A frame freed on another thread than the one it came from simply joins
+ * that thread's lists. */
+class FrameRecycler
+{
+public:
+    static void* allocate(size_t size)
+    {
+        size_t cls = (size + GRANULE - 1) / GRANULE;
+        Cache& cache = get_cache();
+        FreeFrame* frame;
+
+        if (cls >= CLASSES)
+            return ::operator new(size);
+
+        frame = cache.heads[cls];
+        if (!frame)
+            return ::operator new(cls * GRANULE);
+
+        cache.heads[cls] = frame->next;
+        cache.counts[cls]--;
+        return frame;
+    }
+
+    static void deallocate(void* p, size_t size)
+    {
+        size_t cls = (size + GRANULE - 1) / GRANULE;
+        Cache& cache = get_cache();
+        FreeFrame* frame = static_cast<FreeFrame*>(p);
+
+        if (cls >= CLASSES || cache.counts[cls] >= CACHE_MAX)
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        frame->next = cache.heads[cls];
+        cache.heads[cls] = frame;
+        cache.counts[cls]++;
+    }
+
+private:
+    static constexpr size_t GRANULE = 64;
+    static constexpr size_t CLASSES = 32;
+    static constexpr size_t CACHE_MAX = 256;
+
+    struct FreeFrame
+    {
+        FreeFrame* next;
+    };
+
+    struct Cache
+    {
+        FreeFrame* heads[CLASSES] = {};
+        size_t counts[CLASSES] = {};
+
+        ~Cache()
+        {
+            for (FreeFrame* frame : heads)
+            {
+                while (frame)
+                {
+                    FreeFrame* next = frame->next;
+
+                    ::operator delete(frame);
+                    frame = next;
+                }
+            }
+        }
+    };
+
+    static Cache& get_cache()
+    {
+        thread_local Cache cache;
+
+        return cache;
+    }
+};
+
+template<class T = void>
+class Task;
+
+namespace detail
+{
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr exception;
+
+    static void* operator new(size_t size)
+    {
+        return FrameRecycler::allocate(size);
+    }
+
+    static void operator delete(void* p, size_t size)
+    {
+        FrameRecycler::deallocate(p, size);
+    }
+
+    // Hand straight over to whoever awaited the task.
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template<class Promise>
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<Promise> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept
+    {
+        exception = std::current_exception();
+    }
+};
+
+template<class T>
+struct Promise : PromiseBase
+{
+    std::optional<T> value;
+
+    Task<T> get_return_object() noexcept;
+
+    template<class U>
+    void return_value(U&& v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T result()
+    {
+        if (exception)
+            std::rethrow_exception(exception);
+
+        return std::move(*value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase
+{
+    Task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+
+    void result()
+    {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+} // namespace detail
+
+/* Started by the first co_await on it, which it resumes when done. Owns
+ * its frame; move-only. */
+template<class T>
+class Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit Task(handle_type h) noexcept : h_(h) {}
+    Task(Task&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_)
+                h_.destroy();
+
+            h_ = std::exchange(other.h_, {});
+        }
+
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return h_.done(); }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> continuation) noexcept
+    {
+        h_.promise().continuation = continuation;
+        return h_;
+    }
+
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    handle_type h_;
+};
+
+namespace detail
+{
+
+template<class T>
+Task<T> Promise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept
+{
+    return Task<void>(
+        std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Drives a Task from a plain thread for sync_wait().
+struct SyncWaiter
+{
+    struct promise_type
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+        std::exception_ptr exception;
+
+        SyncWaiter get_return_object() noexcept
+        {
+            return SyncWaiter{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            // Suspended by now, so the waiter may destroy the frame as
+            // soon as the lock is dropped.
+            void await_suspend(
+                std::coroutine_handle<promise_type> h) noexcept
+            {
+                promise_type& p = h.promise();
+                std::lock_guard<std::mutex> lock(p.mutex);
+
+                p.done = true;
+                p.cond.notify_one();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept
+        {
+            exception = std::current_exception();
+        }
+    };
+
+    std::coroutine_handle<promise_type> h;
+
+    void wait()
+    {
+        promise_type& p = h.promise();
+
+        h.resume();
+        std::unique_lock<std::mutex> lock(p.mutex);
+        p.cond.wait(lock, [&p] { return p.done; });
+        lock.unlock();
+        if (p.exception)
+        {
+            std::exception_ptr exception = p.exception;
+
+            h.destroy();
+            std::rethrow_exception(exception);
+        }
+
+        h.destroy();
+    }
+};
+
+template<class T>
+SyncWaiter sync_wait_impl(Task<T>& task, std::optional<T>& result)
+{
+    result.emplace(co_await task);
+}
+
+inline SyncWaiter sync_wait_impl(Task<void>& task)
+{
+    co_await task;
+}
+
+} // namespace detail
+
+/* Run a task to completion from outside the pool, blocking the caller.
+ * Not for use on a worker, which it would tie up. */
+template<class T>
+T sync_wait(Task<T> task)
+{
+    std::optional<T> result;
+
+    detail::sync_wait_impl(task, result).wait();
+    return std::move(*result);
+}
+
+inline void sync_wait(Task<void> task)
+{
+    detail::sync_wait_impl(task).wait();
+}
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t nthreads, size_t stacksize = 0) :
+        pool_(thrdpool_create(nthreads, stacksize))
+    {
+        if (!pool_)
+            throw std::system_error(errno, std::generic_category());
+    }
+
+    explicit ThreadPool(const struct thrdpool_params& params) :
+        pool_(thrdpool_create_ex(&params))
+    {
+        if (!pool_)
+            throw std::system_error(errno, std::generic_category());
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() { thrdpool_destory(nullptr, pool_); }
+
+    thrdpool_t* get() const noexcept { return pool_; }
+
+    /* co_await pool.schedule() resumes on a worker. Awaited from a worker
+     * of this pool with a deque, it stays local unless a peer is idle. */
+    class ScheduleAwaiter
+    {
+    public:
+        explicit ScheduleAwaiter(thrdpool_t* pool) noexcept : pool_(pool) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            struct thrdpool_task task = {
+                .routine = &ScheduleAwaiter::resume,
+                .context = h.address(),
+            };
+
+            thrdpool_schedule_inplace(&task, &entry_, pool_);
+        }
+
+        void await_resume() const noexcept {}
+
+    private:
+        static void resume(void* context)
+        {
+            std::coroutine_handle<>::from_address(context).resume();
+        }
+
+        thrdpool_t* pool_;
+        struct thrdpool_task_entry entry_;
+    };
+
+    ScheduleAwaiter schedule() const noexcept
+    {
+        return ScheduleAwaiter(pool_);
+    }
+
+private:
+    thrdpool_t* pool_;
+};
+
+} // namespace serverflow
+
+#endif
@@ -0,0 +1,215 @@
+#include "flow.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "msgqueue.h"
+
+struct __flow
+{
+    int linkoff;
+    flow_stage_t* stages;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t inflight; // put in and not yet done
+};
+
+struct __flow_stage
+{
+    msgqueue_t* queue;
+    flow_routine_t routine;
+    void* context;
+    flow_t* flow;
+    size_t busy; // messages inside routine
+    size_t nthreads;
+    pthread_t* tids;
+    flow_stage_t* next;
+};
+
+flow_t* flow_create(int linkoff)
+{
+    flow_t* flow = (flow_t*)malloc(sizeof(flow_t));
+    int ret;
+
+    if (!flow)
+        return NULL;
+
+    ret = pthread_mutex_init(&flow->mutex, NULL);
+    if (ret == 0)
+    {
+        ret = pthread_cond_init(&flow->cond, NULL);
+        if (ret == 0)
+        {
+            flow->linkoff = linkoff;
+            flow->stages = NULL;
+            flow->inflight = 0;
+            return flow;
+        }
+
+        pthread_mutex_destroy(&flow->mutex);
+    }
+
+    errno = ret;
+    free(flow);
+    return NULL;
+}
+
+static void __flow_done(flow_t* flow)
+{
+    if (__atomic_sub_fetch(&flow->inflight, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&flow->mutex);
+        pthread_cond_broadcast(&flow->cond);
+        pthread_mutex_unlock(&flow->mutex);
+    }
+}
+
+static void* __flow_routine(void* arg)
+{
+    flow_stage_t* stage = (flow_stage_t*)arg;
+    flow_stage_t* next;
+    void* msg;
+
+    while ((msg = msgqueue_get(stage->queue)) != NULL)
+    {
+        __atomic_fetch_add(&stage->busy, 1, __ATOMIC_RELAXED);
+        next = stage->routine(msg, stage->context);
+        __atomic_fetch_sub(&stage->busy, 1, __ATOMIC_RELAXED);
+        // Blocks while next is full: that is the backpressure.
+        if (next)
+            msgqueue_put(msg, next->queue);
+        else
+            __flow_done(stage->flow);
+    }
+
+    return NULL;
+}
+
+// Only once nothing can be put to the stage any more.
+static void __flow_stage_stop(size_t nthreads, flow_stage_t* stage)
+{
+    size_t i;
+
+    msgqueue_set_nonblock(stage->queue);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(stage->tids[i], NULL);
+}
+
+flow_stage_t* flow_stage_create(flow_routine_t routine, void* context,
+                                size_t nthreads, size_t maxlen,
+                                flow_t* flow)
+{
+    flow_stage_t* stage;
+    size_t i;
+    int ret;
+
+    if (nthreads == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    stage = (flow_stage_t*)malloc(sizeof(flow_stage_t));
+    if (!stage)
+        return NULL;
+
+    stage->tids = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    if (stage->tids)
+    {
+        stage->queue = msgqueue_create(maxlen, flow->linkoff);
+        if (stage->queue)
+        {
+            stage->routine = routine;
+            stage->context = context;
+            stage->flow = flow;
+            stage->busy = 0;
+            for (i = 0; i < nthreads; i++)
+            {
+                ret = pthread_create(&stage->tids[i], NULL, __flow_routine,
+                                     stage);
+                if (ret != 0)
+                    break;
+            }
+
+            if (i == nthreads)
+            {
+                stage->nthreads = nthreads;
+                pthread_mutex_lock(&flow->mutex);
+                stage->next = flow->stages;
+                flow->stages = stage;
+                pthread_mutex_unlock(&flow->mutex);
+                return stage;
+            }
+
+            __flow_stage_stop(i, stage);
+            msgqueue_destory(stage->queue);
+            errno = ret;
+        }
+
+        free(stage->tids);
+    }
+
+    free(stage);
+    return NULL;
+}
+
+static int __flow_put(void* msg, int wait, flow_stage_t* stage)
+{
+    flow_t* flow = stage->flow;
+    int ret;
+
+    __atomic_fetch_add(&flow->inflight, 1, __ATOMIC_RELAXED);
+    if (wait)
+        ret = msgqueue_put(msg, stage->queue);
+    else
+        ret = msgqueue_try_put(msg, stage->queue);
+
+    if (ret < 0)
+        __flow_done(flow);
+
+    return ret;
+}
+
+int flow_put(void* msg, flow_stage_t* stage)
+{
+    return __flow_put(msg, 1, stage);
+}
+
+int flow_try_put(void* msg, flow_stage_t* stage)
+{
+    return __flow_put(msg, 0, stage);
+}
+
+size_t flow_stage_size(flow_stage_t* stage)
+{
+    return msgqueue_size(stage->queue) +
+           __atomic_load_n(&stage->busy, __ATOMIC_RELAXED);
+}
+
+void flow_wait(flow_t* flow)
+{
+    pthread_mutex_lock(&flow->mutex);
+    while (__atomic_load_n(&flow->inflight, __ATOMIC_ACQUIRE) != 0)
+        pthread_cond_wait(&flow->cond, &flow->mutex);
+
+    pthread_mutex_unlock(&flow->mutex);
+}
+
+void flow_destory(flow_t* flow)
+{
+    flow_stage_t* stage;
+
+    flow_wait(flow);
+    while (flow->stages)
+    {
+        stage = flow->stages;
+        flow->stages = stage->next;
+        __flow_stage_stop(stage->nthreads, stage);
+        msgqueue_destory(stage->queue);
+        free(stage->tids);
+        free(stage);
+    }
+
+    pthread_cond_destroy(&flow->cond);
+    pthread_mutex_destroy(&flow->mutex);
+    free(flow);
+}
@@ -0,0 +1,47 @@
+#ifndef _FLOW_H_
+#define _FLOW_H_
+
+#include <stddef.h>
+
+/* Stages of a request pipeline. Every stage has a msgqueue and a fixed set
+ * of threads of its own; a stage's routine handles one message and says
+ * which stage it goes to next. Messages travel by their link field at the
+ * flow's linkoff, so a hop allocates and copies nothing. A stage with a
+ * maxlen makes whoever feeds it wait while it is full, which holds up the
+ * stage before it in turn, back to flow_put(). Stages must form a DAG: a
+ * cycle of full queues would never drain. */
+
+typedef struct __flow flow_t;
+typedef struct __flow_stage flow_stage_t;
+
+/* Returns the stage of the same flow to pass msg on to, or NULL once the
+ * flow is done with it. */
+typedef flow_stage_t *(*flow_routine_t)(void *msg, void *context);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+flow_t *flow_create(int linkoff);
+/* nthreads workers run routine, so at most that many messages are in the
+ * stage at once; maxlen bounds its queue, 0 for unbounded. */
+flow_stage_t *flow_stage_create(flow_routine_t routine, void *context,
+                                size_t nthreads, size_t maxlen,
+                                flow_t *flow);
+/* Feed a message in from outside the flow. flow_put() waits while the
+ * stage is full; flow_try_put() fails with EAGAIN instead. */
+int flow_put(void *msg, flow_stage_t *stage);
+int flow_try_put(void *msg, flow_stage_t *stage);
+/* Messages queued on or running in the stage; approximate. */
+size_t flow_stage_size(flow_stage_t *stage);
+/* Wait until every message put in has left the flow. */
+void flow_wait(flow_t *flow);
+/* Waits like flow_wait(), then stops and frees every stage. Nothing may be
+ * put in meanwhile. */
+void flow_destory(flow_t *flow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
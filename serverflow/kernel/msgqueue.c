@@ -1,64 +1,366 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "msgqueue.h"
+#include "trace.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define MSGQUEUE_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define MSGQUEUE_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define MSGQUEUE_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
 
+#define MSGQUEUE_CACHELINE 64
+
+/* Consumers and producers work on separate cache lines: the get side is
+ * only touched under get_mutex, the put side under put_mutex or by
+ * lock-free producers. msg_cnt is on the put side; a spinning consumer
+ * reads it, which is the one line both sides must share. */
 struct __msgqueue {
   size_t msg_max;
-  size_t msg_cnt;
   int link_off;
   int nonblock;
+  int flags;
+  int spin_max;
+  int efd;
+  int policy;
+  void (*drop)(void *, void *);
+  void *drop_context;
+  size_t wm_high;
+  size_t wm_low;
+  void (*wm_hook)(msgqueue_t *, int, void *);
+  void *wm_context;
+  int wm_above;
+
+  pthread_mutex_t get_mutex __attribute__((aligned(MSGQUEUE_CACHELINE)));
+  void **get_head;
+  size_t get_cnt;
+  int spin_avg;
+  void **lf_head;
+  void *lf_stub;
   void *head1;
   void *head2;
-  void **get_head;
+
+  pthread_mutex_t put_mutex __attribute__((aligned(MSGQUEUE_CACHELINE)));
   void **put_head;
   void **put_tail;
-  pthread_mutex_t get_mutex;
-  pthread_mutex_t put_mutex;
+  size_t msg_cnt;
+  size_t msg_hwm;
+  int get_waiters;
+  int put_waiters;
+  int armed; // MSGQUEUE_EVENTFD: a consumer found the queue empty
+  void **lf_tail;
+  size_t lf_cnt; // lock-free slots taken, pushed or about to be
   pthread_cond_t get_cond;
   pthread_cond_t put_cond;
 };
 
-static size_t __msgqueue_swap(msgqueue_t *queue) {
+/* Called with get_mutex held, so at most one consumer spins at a time. The
+ * spin budget adapts like an adaptive mutex: it grows toward the spin count
+ * that found a message and decays while spinning keeps failing. */
+static void __msgqueue_spin(msgqueue_t *queue) {
+  int limit = 2 * queue->spin_avg + 16;
+  int i;
+
+  if (limit > queue->spin_max) {
+    limit = queue->spin_max;
+  }
+
+  for (i = 0; i < limit; i++) {
+    if (__atomic_load_n(&queue->msg_cnt, __ATOMIC_RELAXED) != 0 ||
+        queue->nonblock) {
+      queue->spin_avg += (i - queue->spin_avg) / 8;
+      return;
+    }
+    MSGQUEUE_CPU_RELAX();
+  }
+
+  queue->spin_avg -= queue->spin_avg / 8;
+}
+
+/* MSGQUEUE_EVENTFD: consumers arm the queue when they find it empty and the
+ * next put disarms it and writes the eventfd, so a burst of puts into an
+ * empty queue costs one write and one poller wakeup. */
+static void __msgqueue_notify(msgqueue_t *queue) {
+  uint64_t one = 1;
+
+  if (write(queue->efd, &one, sizeof(one)) < 0) {
+    // EAGAIN: the counter is already nonzero, so the poller will wake.
+  }
+}
+
+// Raise the high watermark to cnt; producers may race, so CAS the max.
+static void __msgqueue_mark(size_t cnt, msgqueue_t *queue) {
+  size_t hwm = __atomic_load_n(&queue->msg_hwm, __ATOMIC_RELAXED);
+
+  while (cnt > hwm &&
+         !__atomic_compare_exchange_n(&queue->msg_hwm, &hwm, cnt, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/* Waits for a message unless wait is 0; abstime, if given, bounds the wait
+ * on the CLOCK_MONOTONIC clock. */
+static size_t __msgqueue_swap(int wait, const struct timespec *abstime,
+                              msgqueue_t *queue) {
   void **get_head = queue->get_head;
   size_t cnt;
 
+  TRACE_POINT(TRACE_SWAP_BEGIN, queue, 0);
   queue->get_head = queue->put_head;
+  if (wait && queue->spin_max > 0 && !queue->nonblock) {
+    __msgqueue_spin(queue);
+  }
+
   pthread_mutex_lock(&queue->put_mutex);
-  while (queue->msg_cnt == 0 && !queue->nonblock) {
-    pthread_cond_wait(&queue->get_cond, &queue->put_mutex);
+  while (queue->msg_cnt == 0 && !queue->nonblock && wait) {
+    queue->get_waiters++;
+    if (!abstime) {
+      pthread_cond_wait(&queue->get_cond, &queue->put_mutex);
+    } else if (pthread_cond_timedwait(&queue->get_cond, &queue->put_mutex,
+                                      abstime) == ETIMEDOUT) {
+      wait = 0;
+    }
+    queue->get_waiters--;
   }
 
   cnt = queue->msg_cnt;
   if (cnt > queue->msg_max - 1) {
     pthread_cond_broadcast(&queue->put_cond);
   }
+  if (cnt == 0) {
+    queue->armed = 1;
+  }
 
   queue->put_head = get_head;
   queue->put_tail = get_head;
-  queue->msg_cnt = 0;
+  __atomic_store_n(&queue->msg_cnt, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&queue->get_cnt, queue->get_cnt + cnt, __ATOMIC_RELAXED);
   pthread_mutex_unlock(&queue->put_mutex);
+  TRACE_POINT(TRACE_SWAP_END, queue, cnt);
   return cnt;
 }
 
+/* MSGQUEUE_LOCKFREE backend: an intrusive Vyukov MPSC list. Producers
+ * only exchange lf_tail, consumers pop lf_head under get_mutex, so the
+ * queue stays safe for many consumers. msg_cnt is raised before a push
+ * and dropped by the pop, so a consumer never sees it count a message
+ * another consumer already holds. put_mutex is taken only to park or wake
+ * a waiter. */
+static void __msgqueue_lf_push(void **first, void **last, msgqueue_t *queue) {
+  void **prev;
+
+  prev = (void **)__atomic_exchange_n(&queue->lf_tail, last, __ATOMIC_ACQ_REL);
+  __atomic_store_n(prev, first, __ATOMIC_RELEASE);
+}
+
+static void **__msgqueue_lf_pop(msgqueue_t *queue) {
+  void **head = queue->lf_head;
+  void **next = (void **)__atomic_load_n(head, __ATOMIC_ACQUIRE);
+  int stub_pushed = 0;
+
+  if (head == &queue->lf_stub) {
+    while (!next) {
+      // Empty, unless a producer has swapped lf_tail but not linked yet.
+      if (__atomic_load_n(&queue->lf_tail, __ATOMIC_ACQUIRE) == head) {
+        return NULL;
+      }
+      sched_yield();
+      next = (void **)__atomic_load_n(head, __ATOMIC_ACQUIRE);
+    }
+    head = next;
+    next = (void **)__atomic_load_n(head, __ATOMIC_ACQUIRE);
+  }
+
+  while (!next) {
+    if (!stub_pushed &&
+        __atomic_load_n(&queue->lf_tail, __ATOMIC_ACQUIRE) == head) {
+      queue->lf_stub = NULL;
+      __msgqueue_lf_push(&queue->lf_stub, &queue->lf_stub, queue);
+      stub_pushed = 1;
+    } else {
+      sched_yield();
+    }
+    next = (void **)__atomic_load_n(head, __ATOMIC_ACQUIRE);
+  }
+
+  queue->lf_head = next;
+  __atomic_fetch_sub(&queue->msg_cnt, 1, __ATOMIC_SEQ_CST);
+  return head;
+}
+
+/* Takes room for n messages ahead of pushing them, so that concurrent
+ * producers cannot all pass the check and overshoot maxlen. As with the
+ * locked backend, a put fits while fewer than maxlen are queued. */
+static int __msgqueue_lf_reserve(size_t n, msgqueue_t *queue) {
+  size_t cnt = __atomic_load_n(&queue->lf_cnt, __ATOMIC_SEQ_CST);
+
+  do {
+    if (cnt > queue->msg_max - 1 && !queue->nonblock) {
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&queue->lf_cnt, &cnt, cnt + n, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  return 0;
+}
 
+static void __msgqueue_lf_wait_put(size_t n, msgqueue_t *queue) {
+  pthread_mutex_lock(&queue->put_mutex);
+  __atomic_fetch_add(&queue->put_waiters, 1, __ATOMIC_SEQ_CST);
+  while (__msgqueue_lf_reserve(n, queue) < 0) {
+    pthread_cond_wait(&queue->put_cond, &queue->put_mutex);
+  }
+  __atomic_fetch_sub(&queue->put_waiters, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&queue->put_mutex);
+}
+
+static void __msgqueue_lf_put(void **first, void **last, size_t n,
+                              msgqueue_t *queue) {
+  __msgqueue_mark(__atomic_add_fetch(&queue->msg_cnt, n, __ATOMIC_SEQ_CST),
+                  queue);
+  __msgqueue_lf_push(first, last, queue);
+  if (queue->efd >= 0 && __atomic_load_n(&queue->armed, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&queue->armed, 0, __ATOMIC_SEQ_CST)) {
+    __msgqueue_notify(queue);
+  }
+  if (__atomic_load_n(&queue->get_waiters, __ATOMIC_SEQ_CST) > 0) {
+    TRACE_POINT(TRACE_WAKE, queue, 1);
+    pthread_mutex_lock(&queue->put_mutex);
+    pthread_cond_signal(&queue->get_cond);
+    pthread_mutex_unlock(&queue->put_mutex);
+  }
+}
+
+/* Called with get_mutex held; wait and abstime as in __msgqueue_swap().
+ * Returns NULL in nonblock mode, or when the queue stays empty. */
+static void **__msgqueue_lf_get(int wait, const struct timespec *abstime,
+                                msgqueue_t *queue) {
+  void **link;
+  int ret = 0;
+
+  while (!(link = __msgqueue_lf_pop(queue))) {
+    if (queue->nonblock || !wait) {
+      if (queue->efd < 0) {
+        return NULL;
+      }
+      // Arm, then look again: a producer either sees armed or its
+      // message is found here.
+      __atomic_store_n(&queue->armed, 1, __ATOMIC_SEQ_CST);
+      return __msgqueue_lf_pop(queue);
+    }
+    if (queue->spin_max > 0) {
+      __msgqueue_spin(queue);
+      if ((link = __msgqueue_lf_pop(queue)) != NULL) {
+        break;
+      }
+    }
+    TRACE_POINT(TRACE_PARK_BEGIN, queue, 0);
+    pthread_mutex_lock(&queue->put_mutex);
+    __atomic_fetch_add(&queue->get_waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&queue->msg_cnt, __ATOMIC_SEQ_CST) == 0 &&
+           !queue->nonblock && ret != ETIMEDOUT) {
+      if (abstime) {
+        ret = pthread_cond_timedwait(&queue->get_cond, &queue->put_mutex,
+                                     abstime);
+      } else {
+        pthread_cond_wait(&queue->get_cond, &queue->put_mutex);
+      }
+    }
+    __atomic_fetch_sub(&queue->get_waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->put_mutex);
+    TRACE_POINT(TRACE_PARK_END, queue, 0);
+    // Counted but not linked yet: the producer is a store away.
+    if (ret == 0 && __atomic_load_n(&queue->msg_cnt, __ATOMIC_RELAXED) != 0 &&
+        !queue->nonblock) {
+      sched_yield();
+    }
+    // Timed out: one last look, then give up.
+    if (ret == ETIMEDOUT) {
+      wait = 0;
+    }
+  }
+
+  return link;
+}
+
+// One wakeup per freed slot; a woken producer that loses it waits again.
+static void __msgqueue_lf_done(size_t n, msgqueue_t *queue) {
+  int waiters;
+
+  __atomic_fetch_sub(&queue->lf_cnt, n, __ATOMIC_SEQ_CST);
+  waiters = __atomic_load_n(&queue->put_waiters, __ATOMIC_SEQ_CST);
+  if (waiters > 0) {
+    pthread_mutex_lock(&queue->put_mutex);
+    while (n > 0 && waiters > 0) {
+      pthread_cond_signal(&queue->put_cond);
+      n--;
+      waiters--;
+    }
+    pthread_mutex_unlock(&queue->put_mutex);
+  }
+}
+
+
+
+// msgqueue_get_timeout() deadlines are on the monotonic clock.
+static int __msgqueue_init_get_cond(msgqueue_t *queue) {
+  pthread_condattr_t attr;
+  int ret;
+
+  ret = pthread_condattr_init(&attr);
+  if (ret == 0) {
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    ret = pthread_cond_init(&queue->get_cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  return ret;
+}
 
 msgqueue_t *msgqueue_create(size_t maxlen, int linkoff) {
-  msgqueue_t *queue = (msgqueue_t *)malloc(sizeof(msgqueue_t));
-  if (!queue) {
+  return msgqueue_create_ex(maxlen, linkoff, 0);
+}
+
+msgqueue_t *msgqueue_create_ex(size_t maxlen, int linkoff, int flags) {
+  msgqueue_t *queue;
+  int ret;
+
+  if (posix_memalign((void **)&queue, MSGQUEUE_CACHELINE,
+                     sizeof(msgqueue_t)) != 0) {
     return NULL;
   }
-  int ret;
 
   ret = pthread_mutex_init(&queue->get_mutex, NULL);
   if (ret == 0) {
     ret = pthread_mutex_init(&queue->put_mutex, NULL);
     if (ret == 0) {
-      ret = pthread_cond_init(&queue->get_cond, NULL);
+      ret = __msgqueue_init_get_cond(queue);
       if (ret == 0) {
         ret = pthread_cond_init(&queue->put_cond, NULL);
         if (ret == 0) {
+          queue->efd = -1;
+          if (flags & MSGQUEUE_EVENTFD) {
+            queue->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (queue->efd < 0) {
+              ret = errno;
+              pthread_cond_destroy(&queue->put_cond);
+              pthread_cond_destroy(&queue->get_cond);
+              pthread_mutex_destroy(&queue->put_mutex);
+              pthread_mutex_destroy(&queue->get_mutex);
+              errno = ret;
+              free(queue);
+              return NULL;
+            }
+          }
           queue->msg_max = maxlen;
           queue->link_off = linkoff;
           queue->head1 = NULL;
@@ -67,7 +369,27 @@ msgqueue_t *msgqueue_create(size_t maxlen, int linkoff) {
           queue->put_head = &queue->head2;
           queue->put_tail = &queue->head2;
           queue->msg_cnt = 0;
+          queue->get_cnt = 0;
+          queue->msg_hwm = 0;
           queue->nonblock = 0;
+          queue->flags = flags;
+          queue->get_waiters = 0;
+          queue->put_waiters = 0;
+          queue->armed = 1;
+          queue->policy = MSGQUEUE_BLOCK;
+          queue->drop = NULL;
+          queue->drop_context = NULL;
+          queue->wm_high = 0;
+          queue->wm_low = 0;
+          queue->wm_hook = NULL;
+          queue->wm_context = NULL;
+          queue->wm_above = 0;
+          queue->spin_max = 0;
+          queue->spin_avg = 0;
+          queue->lf_stub = NULL;
+          queue->lf_head = &queue->lf_stub;
+          queue->lf_tail = &queue->lf_stub;
+          queue->lf_cnt = 0;
           return queue;
         }
       }
@@ -79,35 +401,349 @@ msgqueue_t *msgqueue_create(size_t maxlen, int linkoff) {
 }
 
 
-void msgqueue_put(void *msg, msgqueue_t *queue) {
-  void **link = (void **)((char *)msg + queue->link_off); // link--->point
-  *link = NULL;
+/* Called with put_mutex held and the put list full. Unlinks its oldest
+ * message onto the dropped chain. The get list is the consumers' and is
+ * left alone, in line with the limit only counting the put list. */
+static void **__msgqueue_shift(void **dropped, msgqueue_t *queue) {
+  void **link = (void **)*queue->put_head;
+
+  *queue->put_head = *link;
+  if (queue->put_tail == link) {
+    queue->put_tail = queue->put_head;
+  }
+  __atomic_store_n(&queue->msg_cnt, queue->msg_cnt - 1, __ATOMIC_RELAXED);
+  *link = dropped;
+  return link;
+}
+
+static void __msgqueue_drop(void **dropped, msgqueue_t *queue) {
+  void **next;
+
+  while (dropped) {
+    next = (void **)*dropped;
+    if (queue->drop) {
+      queue->drop((char *)dropped - queue->link_off, queue->drop_context);
+    }
+    dropped = next;
+  }
+}
+
+/* Lock-free backend: pop the oldest messages until room for the new ones
+ * is reserved. A consumer parks holding get_mutex, and only does so with
+ * nothing queued, so a busy get_mutex means slots free up by themselves. */
+static void __msgqueue_lf_drop(size_t n, msgqueue_t *queue) {
+  void **link;
+
+  while (__msgqueue_lf_reserve(n, queue) < 0) {
+    if (pthread_mutex_trylock(&queue->get_mutex) != 0) {
+      sched_yield();
+      continue;
+    }
+    link = __msgqueue_lf_pop(queue);
+    pthread_mutex_unlock(&queue->get_mutex);
+    if (!link) {
+      // Every slot is taken by a producer still pushing.
+      sched_yield();
+      continue;
+    }
+    __msgqueue_lf_done(1, queue);
+    *link = NULL;
+    __msgqueue_drop(link, queue);
+  }
+}
+
+// Watermark hooks fire once per crossing, outside any lock.
+static void __msgqueue_check_high(msgqueue_t *queue) {
+  if (queue->wm_hook && !__atomic_load_n(&queue->wm_above, __ATOMIC_RELAXED) &&
+      msgqueue_size(queue) >= queue->wm_high &&
+      !__atomic_exchange_n(&queue->wm_above, 1, __ATOMIC_ACQ_REL)) {
+    queue->wm_hook(queue, 1, queue->wm_context);
+  }
+}
+
+static void __msgqueue_check_low(msgqueue_t *queue) {
+  if (queue->wm_hook && __atomic_load_n(&queue->wm_above, __ATOMIC_RELAXED) &&
+      msgqueue_size(queue) <= queue->wm_low &&
+      __atomic_exchange_n(&queue->wm_above, 0, __ATOMIC_ACQ_REL)) {
+    queue->wm_hook(queue, 0, queue->wm_context);
+  }
+}
+
+/* Appends the chain first..last of n messages. A full queue is handled by
+ * the overload policy; wait 0 turns MSGQUEUE_BLOCK into failing. */
+static int __msgqueue_put_list(void **first, void **last, size_t n, int wait,
+                               msgqueue_t *queue) {
+  void **dropped = NULL;
+  int waiters;
+  int armed;
+
+  if (queue->policy == MSGQUEUE_FAIL) {
+    wait = 0;
+  }
+
+  *last = NULL;
+  if (queue->flags & MSGQUEUE_LOCKFREE) {
+    if (__msgqueue_lf_reserve(n, queue) < 0) {
+      if (queue->policy == MSGQUEUE_DROP_OLDEST) {
+        __msgqueue_lf_drop(n, queue);
+      } else if (!wait) {
+        return -1;
+      } else {
+        __msgqueue_lf_wait_put(n, queue);
+      }
+    }
+    __msgqueue_lf_put(first, last, n, queue);
+    TRACE_POINT(TRACE_ENQUEUE, queue, n);
+    __msgqueue_check_high(queue);
+    return 0;
+  }
+
   pthread_mutex_lock(&queue->put_mutex);
   while (queue->msg_cnt > queue->msg_max - 1 && !queue->nonblock) {
-    pthread_cond_wait(&queue->put_cond, &queue->put_mutex);
+    if (queue->policy == MSGQUEUE_DROP_OLDEST) {
+      dropped = __msgqueue_shift(dropped, queue);
+    } else if (!wait) {
+      pthread_mutex_unlock(&queue->put_mutex);
+      return -1;
+    } else {
+      pthread_cond_wait(&queue->put_cond, &queue->put_mutex);
+    }
   }
-  *queue->put_tail = link;
-  queue->put_tail = link;
+  *queue->put_tail = first;
+  queue->put_tail = last;
+  __atomic_store_n(&queue->msg_cnt, queue->msg_cnt + n, __ATOMIC_RELAXED);
+  __msgqueue_mark(queue->msg_cnt +
+                      __atomic_load_n(&queue->get_cnt, __ATOMIC_RELAXED),
+                  queue);
+  waiters = queue->get_waiters;
+  armed = queue->armed;
+  queue->armed = 0;
   pthread_mutex_unlock(&queue->put_mutex);
-  pthread_cond_signal(&queue->get_cond);
+  // A spinning consumer will see msg_cnt by itself; only wake a parked one.
+  TRACE_POINT(TRACE_ENQUEUE, queue, n);
+  if (waiters > 0) {
+    TRACE_POINT(TRACE_WAKE, queue, 1);
+    pthread_cond_signal(&queue->get_cond);
+  }
+  if (armed && queue->efd >= 0) {
+    __msgqueue_notify(queue);
+  }
+  __msgqueue_drop(dropped, queue);
+  __msgqueue_check_high(queue);
+  return 0;
 }
 
-void *msgqueue_get(msgqueue_t *queue) {
+int msgqueue_put(void *msg, msgqueue_t *queue) {
+  void **link = (void **)((char *)msg + queue->link_off); // link--->point
+
+  if (__msgqueue_put_list(link, link, 1, 1, queue) < 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return 0;
+}
+
+int msgqueue_try_put(void *msg, msgqueue_t *queue) {
+  void **link = (void **)((char *)msg + queue->link_off);
+
+  if (__msgqueue_put_list(link, link, 1, 0, queue) < 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return 0;
+}
+
+int msgqueue_put_list(void *head, void *tail, size_t n, msgqueue_t *queue) {
+  void **first = (void **)((char *)head + queue->link_off);
+  void **last = (void **)((char *)tail + queue->link_off);
+
+  if (__msgqueue_put_list(first, last, n, 1, queue) < 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return 0;
+}
+
+// Called with get_mutex held, which it releases.
+static void *__msgqueue_get(int wait, const struct timespec *abstime,
+                            msgqueue_t *queue) {
+  void **link;
   void *msg;
 
-  pthread_mutex_lock(&queue->get_mutex);
-  if (*queue->get_head || __msgqueue_swap(queue) > 0) {
+  if (queue->flags & MSGQUEUE_LOCKFREE) {
+    link = __msgqueue_lf_get(wait, abstime, queue);
+    pthread_mutex_unlock(&queue->get_mutex);
+    if (!link) {
+      return NULL;
+    }
+    TRACE_POINT(TRACE_DEQUEUE, queue, 1);
+    __msgqueue_lf_done(1, queue);
+    __msgqueue_check_low(queue);
+    return (char *)link - queue->link_off;
+  }
+
+  if (*queue->get_head || __msgqueue_swap(wait, abstime, queue) > 0) {
     msg = (char *)(*queue->get_head - queue->link_off);
     *queue->get_head = *(void**)(*queue->get_head);
+    __atomic_store_n(&queue->get_cnt, queue->get_cnt - 1, __ATOMIC_RELAXED);
   } else {
     msg = NULL;
   }
   pthread_mutex_unlock(&queue->get_mutex);
+  if (msg) {
+    TRACE_POINT(TRACE_DEQUEUE, queue, 1);
+    __msgqueue_check_low(queue);
+  }
   return msg;
 }
 
+void *msgqueue_get(msgqueue_t *queue) {
+  pthread_mutex_lock(&queue->get_mutex);
+  return __msgqueue_get(1, NULL, queue);
+}
+
+/* A consumer blocked in msgqueue_get() holds get_mutex while it waits, so
+ * a busy get_mutex is taken to mean there is nothing to get right now. */
+void *msgqueue_try_get(msgqueue_t *queue) {
+  if (pthread_mutex_trylock(&queue->get_mutex) != 0) {
+    return NULL;
+  }
+  return __msgqueue_get(0, NULL, queue);
+}
+
+void *msgqueue_get_timeout(msgqueue_t *queue, long long ns) {
+  struct timespec abstime;
+
+  if (ns <= 0) {
+    return msgqueue_try_get(queue);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &abstime);
+  abstime.tv_sec += ns / 1000000000;
+  abstime.tv_nsec += ns % 1000000000;
+  if (abstime.tv_nsec >= 1000000000) {
+    abstime.tv_nsec -= 1000000000;
+    abstime.tv_sec++;
+  }
+
+  if (pthread_mutex_clocklock(&queue->get_mutex, CLOCK_MONOTONIC,
+                              &abstime) != 0) {
+    return NULL;
+  }
+  return __msgqueue_get(1, &abstime, queue);
+}
+
+// Called with get_mutex held, which it releases.
+static size_t __msgqueue_get_batch(int wait, msgqueue_t *queue, void *msgs[],
+                                   size_t max) {
+  void **link;
+  size_t n = 0;
+
+  if (queue->flags & MSGQUEUE_LOCKFREE) {
+    if (max > 0 && (link = __msgqueue_lf_get(wait, NULL, queue))) {
+      do {
+        msgs[n++] = (char *)link - queue->link_off;
+      } while (n < max && (link = __msgqueue_lf_pop(queue)));
+    }
+    pthread_mutex_unlock(&queue->get_mutex);
+    if (n > 0) {
+      TRACE_POINT(TRACE_DEQUEUE, queue, n);
+      __msgqueue_lf_done(n, queue);
+      __msgqueue_check_low(queue);
+    }
+    return n;
+  }
+
+  if (max > 0 &&
+      (*queue->get_head || __msgqueue_swap(wait, NULL, queue) > 0)) {
+    do {
+      msgs[n++] = (char *)*queue->get_head - queue->link_off;
+      *queue->get_head = *(void **)(*queue->get_head);
+    } while (n < max && *queue->get_head);
+    __atomic_store_n(&queue->get_cnt, queue->get_cnt - n, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&queue->get_mutex);
+  if (n > 0) {
+    TRACE_POINT(TRACE_DEQUEUE, queue, n);
+    __msgqueue_check_low(queue);
+  }
+  return n;
+}
+
+size_t msgqueue_get_batch(msgqueue_t *queue, void *msgs[], size_t max) {
+  pthread_mutex_lock(&queue->get_mutex);
+  return __msgqueue_get_batch(1, queue, msgs, max);
+}
+
+size_t msgqueue_try_get_batch(msgqueue_t *queue, void *msgs[], size_t max) {
+  if (pthread_mutex_trylock(&queue->get_mutex) != 0) {
+    return 0;
+  }
+  return __msgqueue_get_batch(0, queue, msgs, max);
+}
+
+int msgqueue_eventfd(msgqueue_t *queue) {
+  return queue->efd;
+}
+
+void msgqueue_set_nonblock(msgqueue_t *queue) {
+  queue->nonblock = 1;
+  pthread_mutex_lock(&queue->put_mutex);
+  pthread_cond_signal(&queue->get_cond);
+  pthread_cond_broadcast(&queue->put_cond);
+  pthread_mutex_unlock(&queue->put_mutex);
+  if (queue->efd >= 0) {
+    __msgqueue_notify(queue);
+  }
+}
+
+void msgqueue_set_block(msgqueue_t *queue) {
+  queue->nonblock = 0;
+}
+
+void msgqueue_set_spin(msgqueue_t *queue, int spin) {
+  queue->spin_max = spin > 0 ? spin : 0;
+}
+
+void msgqueue_set_policy(msgqueue_t *queue, int policy,
+                         void (*drop)(void *msg, void *context),
+                         void *context) {
+  queue->drop = drop;
+  queue->drop_context = context;
+  queue->policy = policy;
+}
+
+void msgqueue_set_watermarks(msgqueue_t *queue, size_t high, size_t low,
+                             void (*hook)(msgqueue_t *, int, void *),
+                             void *context) {
+  queue->wm_high = high;
+  queue->wm_low = low < high ? low : high - 1;
+  queue->wm_context = context;
+  queue->wm_above = 0;
+  queue->wm_hook = high > 0 ? hook : NULL;
+}
+
+/* The locked backend counts the put list in msg_cnt and what is left of
+ * the swapped-in get list in get_cnt; the lock-free one keeps the total in
+ * msg_cnt. Read without locking, so only a snapshot. */
+size_t msgqueue_size(msgqueue_t *queue) {
+  size_t cnt = __atomic_load_n(&queue->msg_cnt, __ATOMIC_RELAXED);
+
+  if (!(queue->flags & MSGQUEUE_LOCKFREE)) {
+    cnt += __atomic_load_n(&queue->get_cnt, __ATOMIC_RELAXED);
+  }
+  return cnt;
+}
+
+size_t msgqueue_high_watermark(msgqueue_t *queue) {
+  return __atomic_load_n(&queue->msg_hwm, __ATOMIC_RELAXED);
+}
+
 
 void msgqueue_destory(msgqueue_t *queue) {
+  if (queue->efd >= 0) {
+    close(queue->efd);
+  }
   pthread_mutex_destroy(&queue->get_mutex);
   pthread_mutex_destroy(&queue->put_mutex);
   pthread_cond_destroy(&queue->put_cond);
@@ -5,15 +5,70 @@
 
 typedef struct __msgqueue msgqueue_t;
 
+/* msgqueue_create_ex() flags. MSGQUEUE_LOCKFREE makes producers append
+ * with an atomic exchange instead of taking put_mutex; maxlen still holds,
+ * each put reserving its room with a CAS first. */
+#define MSGQUEUE_LOCKFREE 0x1
+/* MSGQUEUE_EVENTFD adds an eventfd, see msgqueue_eventfd(). */
+#define MSGQUEUE_EVENTFD 0x2
+
+/* Overload policies, for msgqueue_set_policy(). What happens to a put that
+ * finds the queue at maxlen: wait for room (the default), fail with
+ * EAGAIN, or make room by dropping the oldest queued messages. */
+#define MSGQUEUE_BLOCK 0
+#define MSGQUEUE_FAIL 1
+#define MSGQUEUE_DROP_OLDEST 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 msgqueue_t *msgqueue_create(size_t maxlen, int linkoff);
-void msgqueue_put(void *msg, msgqueue_t *queue);
+msgqueue_t *msgqueue_create_ex(size_t maxlen, int linkoff, int flags);
+int msgqueue_put(void *msg, msgqueue_t *queue);
 void *msgqueue_get(msgqueue_t *queue);
+/* Per-call non-blocking variants. msgqueue_try_put() returns -1 with errno
+ * EAGAIN instead of waiting for room. msgqueue_try_get() returns NULL when
+ * nothing is queued or another consumer holds the get side, and
+ * msgqueue_get_timeout() when nothing arrives within ns nanoseconds. */
+int msgqueue_try_put(void *msg, msgqueue_t *queue);
+void *msgqueue_try_get(msgqueue_t *queue);
+void *msgqueue_get_timeout(msgqueue_t *queue, long long ns);
+/* Batch variants. A list handed to msgqueue_put_list() is chained through
+ * the link field: each message's link holds the address of the next
+ * message's link field, the same layout msgqueue keeps internally. The
+ * whole chain is spliced in one critical section. msgqueue_get_batch()
+ * blocks like msgqueue_get() and returns 0 only in nonblock mode. */
+int msgqueue_put_list(void *head, void *tail, size_t n, msgqueue_t *queue);
+size_t msgqueue_get_batch(msgqueue_t *queue, void *msgs[], size_t max);
+size_t msgqueue_try_get_batch(msgqueue_t *queue, void *msgs[], size_t max);
+/* With MSGQUEUE_EVENTFD, the returned fd becomes readable when a put finds
+ * the queue drained, and on msgqueue_set_nonblock(). A poller should read
+ * the fd first, then call the try_get variants until they come back
+ * empty; puts made after that are signalled again. -1 without the flag. */
+int msgqueue_eventfd(msgqueue_t *queue);
 void msgqueue_set_nonblock(msgqueue_t *queue);
 void msgqueue_set_block(msgqueue_t *queue);
+/* Let an idle consumer spin for up to `spin' iterations before parking on
+ * the condition. Producers skip the wakeup while the consumer spins. The
+ * actual spin length adapts to how long messages took to arrive. */
+void msgqueue_set_spin(msgqueue_t *queue, int spin);
+/* Puts return -1 only under MSGQUEUE_FAIL. Dropped messages are handed to
+ * drop(msg, context), outside any lock; drop may be NULL. Not to be
+ * changed while producers run. */
+void msgqueue_set_policy(msgqueue_t *queue, int policy,
+                         void (*drop)(void *msg, void *context),
+                         void *context);
+/* hook(queue, 1, context) runs when a put brings the queue to high
+ * messages, and hook(queue, 0, context) once a get takes it back down to
+ * low. high 0 disables. */
+void msgqueue_set_watermarks(msgqueue_t *queue, size_t high, size_t low,
+                             void (*hook)(msgqueue_t *, int, void *),
+                             void *context);
+/* Number of queued messages, and the most ever queued at once. Both are
+ * approximate while producers and consumers are running. */
+size_t msgqueue_size(msgqueue_t *queue);
+size_t msgqueue_high_watermark(msgqueue_t *queue);
 void msgqueue_destory(msgqueue_t *);
 
 #ifdef __cplusplus
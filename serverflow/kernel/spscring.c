@@ -0,0 +1,289 @@
+#include "spscring.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPSCRING_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define SPSCRING_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define SPSCRING_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define SPSCRING_CACHELINE 64
+#define SPSCRING_RECHECK 64 // spins on the index once the flag is up
+#define SPSCRING_RECHECK_NS 1000000 // first sleep of a waiting side
+
+/* tail and head_cache belong to the producer, head and tail_cache to the
+ * consumer. A waiting side raises its flag under the mutex; the other
+ * side checks the flag after every index store, with a plain load. */
+struct __spscring
+{
+    size_t tail __attribute__((aligned(SPSCRING_CACHELINE)));
+    size_t head_cache;
+    size_t head __attribute__((aligned(SPSCRING_CACHELINE)));
+    size_t tail_cache;
+    size_t mask __attribute__((aligned(SPSCRING_CACHELINE)));
+    void** buf;
+    int spin;
+    int nonblock;
+    int get_waiting;
+    int put_waiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t get_cond;
+    pthread_cond_t put_cond;
+};
+
+static int __spscring_cond_init(pthread_cond_t* cond)
+{
+    pthread_condattr_t attr;
+    int ret;
+
+    ret = pthread_condattr_init(&attr);
+    if (ret == 0)
+    {
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        ret = pthread_cond_init(cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    return ret;
+}
+
+spscring_t* spscring_create(size_t capacity)
+{
+    spscring_t* ring;
+    size_t size = 1;
+    int ret;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if (posix_memalign((void**)&ring, SPSCRING_CACHELINE,
+                       sizeof(spscring_t)) != 0)
+        return NULL;
+
+    ring->buf = (void**)malloc(size * sizeof(void*));
+    if (ring->buf)
+    {
+        ret = pthread_mutex_init(&ring->mutex, NULL);
+        if (ret == 0)
+        {
+            ret = __spscring_cond_init(&ring->get_cond);
+            if (ret == 0)
+            {
+                ret = __spscring_cond_init(&ring->put_cond);
+                if (ret == 0)
+                {
+                    ring->tail = 0;
+                    ring->head_cache = 0;
+                    ring->head = 0;
+                    ring->tail_cache = 0;
+                    ring->mask = size - 1;
+                    ring->spin = 0;
+                    ring->nonblock = 0;
+                    ring->get_waiting = 0;
+                    ring->put_waiting = 0;
+                    return ring;
+                }
+
+                pthread_cond_destroy(&ring->get_cond);
+            }
+
+            pthread_mutex_destroy(&ring->mutex);
+        }
+
+        errno = ret;
+        free(ring->buf);
+    }
+
+    free(ring);
+    return NULL;
+}
+
+/* Wait for the other side to move *index off value. Returns 0 if the ring
+ * went nonblocking first. The fence that pairs the flag with the index is
+ * paid here only: the other side may look at the flag before its own
+ * index store is visible, and so miss it. That store is a moment from
+ * landing, so rechecking for a while, then sleeping briefly the first
+ * time, catches it; a later store sees the flag, up by then. */
+static int __spscring_wait(const size_t* index, size_t value, int* waiting,
+                           pthread_cond_t* cond, spscring_t* ring)
+{
+    struct timespec abstime;
+    int timed = 1;
+    int ret = 1;
+    int i;
+
+    for (i = 0; i < ring->spin; i++)
+    {
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != value)
+            return 1;
+
+        SPSCRING_CPU_RELAX();
+    }
+
+    pthread_mutex_lock(&ring->mutex);
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < SPSCRING_RECHECK; i++)
+    {
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != value)
+            break;
+
+        SPSCRING_CPU_RELAX();
+    }
+
+    while (__atomic_load_n(index, __ATOMIC_ACQUIRE) == value)
+    {
+        if (ring->nonblock)
+        {
+            ret = 0;
+            break;
+        }
+
+        if (timed)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &abstime);
+            abstime.tv_nsec += SPSCRING_RECHECK_NS;
+            if (abstime.tv_nsec >= 1000000000)
+            {
+                abstime.tv_nsec -= 1000000000;
+                abstime.tv_sec++;
+            }
+
+            pthread_cond_timedwait(cond, &ring->mutex, &abstime);
+            timed = 0;
+        }
+        else
+            pthread_cond_wait(cond, &ring->mutex);
+    }
+
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ring->mutex);
+    return ret;
+}
+
+// No fence: a waiter that this misses rechecks the index on its own.
+static void __spscring_wake(int* waiting, pthread_cond_t* cond,
+                            spscring_t* ring)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&ring->mutex);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+static int __spscring_put(void* msg, int wait, spscring_t* ring)
+{
+    size_t tail = ring->tail;
+
+    if (tail - ring->head_cache > ring->mask)
+    {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache > ring->mask)
+        {
+            if (!wait || ring->nonblock ||
+                !__spscring_wait(&ring->head, ring->head_cache,
+                                 &ring->put_waiting, &ring->put_cond, ring))
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    ring->buf[tail & ring->mask] = msg;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    __spscring_wake(&ring->get_waiting, &ring->get_cond, ring);
+    return 0;
+}
+
+static void* __spscring_get(int wait, spscring_t* ring)
+{
+    size_t head = ring->head;
+    void* msg;
+
+    if (head == ring->tail_cache)
+    {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->tail_cache)
+        {
+            if (!wait || ring->nonblock ||
+                !__spscring_wait(&ring->tail, head, &ring->get_waiting,
+                                 &ring->get_cond, ring))
+            {
+                return NULL;
+            }
+
+            ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    msg = ring->buf[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    __spscring_wake(&ring->put_waiting, &ring->put_cond, ring);
+    return msg;
+}
+
+int spscring_put(void* msg, spscring_t* ring)
+{
+    return __spscring_put(msg, 1, ring);
+}
+
+void* spscring_get(spscring_t* ring)
+{
+    return __spscring_get(1, ring);
+}
+
+int spscring_try_put(void* msg, spscring_t* ring)
+{
+    return __spscring_put(msg, 0, ring);
+}
+
+void* spscring_try_get(spscring_t* ring)
+{
+    return __spscring_get(0, ring);
+}
+
+void spscring_set_nonblock(spscring_t* ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    ring->nonblock = 1;
+    pthread_cond_broadcast(&ring->get_cond);
+    pthread_cond_broadcast(&ring->put_cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+void spscring_set_block(spscring_t* ring)
+{
+    ring->nonblock = 0;
+}
+
+void spscring_set_spin(spscring_t* ring, int spin)
+{
+    ring->spin = spin > 0 ? spin : 0;
+}
+
+size_t spscring_size(spscring_t* ring)
+{
+    // head first: read the other way round it could pass the tail we saw.
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+void spscring_destory(spscring_t* ring)
+{
+    pthread_cond_destroy(&ring->put_cond);
+    pthread_cond_destroy(&ring->get_cond);
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring->buf);
+    free(ring);
+}
@@ -0,0 +1,42 @@
+#ifndef _SPSCRING_H_
+#define _SPSCRING_H_
+
+#include <stddef.h>
+
+/* Bounded ring for exactly one producer thread and one consumer thread.
+ * Each side keeps its own index and a cached copy of the other's, so a
+ * put or get touches no lock and, while the ring is neither full nor
+ * empty, rarely the other side's cache line. Only a side that has to wait
+ * takes the mutex. Messages are stored by pointer; no link field. */
+
+typedef struct __spscring spscring_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* capacity is rounded up to a power of two. */
+spscring_t *spscring_create(size_t capacity);
+/* Like msgqueue_put() and msgqueue_get(): a put waits while the ring is
+ * full and a get while it is empty. In nonblock mode both return at once,
+ * a put with -1 and errno EAGAIN, a get with NULL. */
+int spscring_put(void *msg, spscring_t *ring);
+void *spscring_get(spscring_t *ring);
+/* Never wait, whatever the mode. */
+int spscring_try_put(void *msg, spscring_t *ring);
+void *spscring_try_get(spscring_t *ring);
+/* Switching to nonblock mode releases a side that is waiting. */
+void spscring_set_nonblock(spscring_t *ring);
+void spscring_set_block(spscring_t *ring);
+/* Iterations a side spins on the other's index before parking; 0 parks
+ * straight away. Not to be changed while either side runs. */
+void spscring_set_spin(spscring_t *ring, int spin);
+/* Approximate while either side runs. */
+size_t spscring_size(spscring_t *ring);
+void spscring_destory(spscring_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
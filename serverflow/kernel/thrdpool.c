@@ -1,262 +1,3881 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "thrdpool.h"
 #include "msgqueue.h"
+#include "wsdeque.h"
+#include "timerwheel.h"
+#include "trace.h"
 #include <complex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
 
+struct __thrdpool_worker;
+struct __thrdpool_timers;
+struct __thrdpool_coros;
+struct __thrdpool_edf;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define THRDPOOL_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define THRDPOOL_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define THRDPOOL_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define THRDPOOL_CACHELINE 64
+
+/* Lane queues are nonblocking; idle workers park on park_cond instead, so
+ * that one wakeup covers every lane and every peer deque. A producer hands
+ * out a wake token only when it sees idle workers and no token is already
+ * outstanding; a woken worker that finds work passes the wakeup on. */
+struct __thrdpool_lane
+{
+    msgqueue_t* queue;
+    int cnt;
+} __attribute__((aligned(THRDPOOL_CACHELINE)));
+
+/* The first block is read on every schedule and fetch but written only
+ * when threads come and go. idle and signals change on every idle
+ * transition and wakeup, and park and thread lifecycle state each have
+ * their own lock; all three get lines of their own. */
 struct __thrdpool
 {
-    msgqueue_t* msgqueue;
+    struct __thrdpool_lane* lanes; // [node * nlanes + prio]
+    int nqueues;
+    int nlanes;
+    int nnodes;
+    int counted; // keep lane counts, for skipping lanes and for growing
+    int starvation_limit;
+    int* cpus;
+    int* cpu_nodes;
+    size_t ncpus;
+    int* cpu_map; // cpu id -> node, -1 if not listed
+    int ncpu_map;
     size_t nthreads;
+    size_t max_threads;
+    size_t min_threads;
+    size_t grow_backlog;
+    int idle_timeout;
+    size_t queue_max;
     size_t stacksize;
-    pthread_t tid;
-    pthread_mutex_t mutex;
+    size_t stack_bytes; // pooled worker stack mapping, 0 to leave to pthread
+    char* tid_stack; // stack of the thread in tid
+    size_t deque_size;
+    int spin;
+    int stats;
+    struct __thrdpool_worker* workers;
     pthread_key_t key;
     pthread_cond_t* terminate;
-};
+    int drain;
+    struct __thrdpool_timers* timers;
+    struct __thrdpool_coros* coros;
+    struct __thrdpool_edf* edf;
+    int deadline_policy;
+    void (*late)(const struct thrdpool_task*, void*);
+    void* late_context;
+    thrdpool_t* peers[2]; // neighbouring shards, see thrdpool_shards_create()
+    size_t coroutine_stacksize;
+    size_t stage_max;
+    int stage_timeout;
+    int inline_depth;
+    int stage_ready; // stage_key exists
+    pthread_key_t stage_key;
+    struct __thrdpool_stage* stages; // every staging list, owned or not
 
-struct __thrdpool_task_entry
-{
-    void* link;
-    struct thrdpool_task task;
+    int idle __attribute__((aligned(THRDPOOL_CACHELINE)));
+    int signals;
+
+    pthread_mutex_t park_mutex __attribute__((aligned(THRDPOOL_CACHELINE)));
+    pthread_cond_t park_cond;
+    int parked;
+
+    pthread_mutex_t mutex __attribute__((aligned(THRDPOOL_CACHELINE)));
+    pthread_t tid;
+    size_t nslots;
 };
 
-static pthread_t __zero_tid;
+/* Written only by the owning worker and summed by thrdpool_get_stats(), so
+ * each slot sits on its own cache lines and needs no atomic RMW. */
+struct __thrdpool_stats
+{
+    unsigned long long tasks;
+    unsigned long long steals;
+    unsigned long long parks;
+    unsigned long long sleeps;
+    unsigned long long wait_hist[THRDPOOL_HIST_BUCKETS];
+    unsigned long long run_hist[THRDPOOL_HIST_BUCKETS];
+} __attribute__((aligned(THRDPOOL_CACHELINE)));
 
-static void* __thrdpool_routine(void* arg)
+/* Workers form a ring that only grows while the pool is alive, so a thief
+ * can walk it from its own slot without locking. A retired worker leaves
+ * its slot behind for the next one to reuse. */
+struct __thrdpool_worker
 {
-    thrdpool_t* pool = (thrdpool_t*)arg;
-    struct __thrdpool_task_entry* entry;
-    void (*task_routine)(void*);
-    void* task_context;
+    thrdpool_t* pool;
+    wsdeque_t* deque;
+    struct __thrdpool_worker* next;
+    size_t index;
     pthread_t tid;
+    char* stack; // from the stack cache, or NULL
+    int retired;
+    int exiting;
+    int node;
+    unsigned int ticks;
+    int spin_avg;
+    int depth; // tasks run inline from thrdpool_schedule(), nested
+    struct thrdpool_task_entry* runnext; // see inline_depth
+    struct __thrdpool_stats stats;
+};
 
-    pthread_setspecific(pool->key, pool);
-    while (!pool->terminate)
-    {
-        entry = (struct __thrdpool_task_entry*)msgqueue_get(pool->msgqueue);
-        if (!entry)
-            break;
+/* pending counts unfinished tasks plus one for the group being open; the
+ * last wait or close drops that one. pending only reaches zero under
+ * mutex, so a waiter that sees it there under the same mutex knows the
+ * completing thread is done with the group. Other completions are a plain
+ * CAS. */
+struct __thrdpool_group
+{
+    thrdpool_t* pool;
+    size_t pending;
+    struct thrdpool_task done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int waiters;
+};
 
-        task_routine = entry->task.routine;
-        task_context = entry->task.context;
+#define THRDPOOL_ENTRY_INPLACE 0x1
+/* An entry behind a handle is freed by whichever of the worker taking it
+ * (STARTED) and the handle's release (RELEASED) comes second. */
+#define THRDPOOL_ENTRY_HANDLE 0x2
+#define THRDPOOL_ENTRY_STARTED 0x4
+#define THRDPOOL_ENTRY_CANCELED 0x8
+#define THRDPOOL_ENTRY_RELEASED 0x10
+// Pool-internal: run only by the pool's own workers, never pulled by a shard.
+#define THRDPOOL_ENTRY_LOCAL 0x20
 
-        free(entry);
-        task_routine(task_context);
+static inline void __thrdpool_stat_add(unsigned long long* counter,
+                                       unsigned long long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
 
-        if (pool->nthreads == 0)
-        {
-            free(pool);
-            return NULL;
-        }
-    }
+static unsigned long long __thrdpool_now(void)
+{
+    struct timespec ts;
 
-    pthread_mutex_lock(&pool->mutex);
-    tid = pool->tid;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    pool->tid = pthread_self();
-    if (--pool->nthreads == 0)
-        pthread_cond_signal(pool->terminate);
+/* Values below 4 get a bucket each; above that, every power of two is split
+ * into 4 linear sub-buckets, up to 2^41 ns. */
+static int __thrdpool_hist_bucket(unsigned long long v)
+{
+    int e;
 
-    pthread_mutex_unlock(&pool->mutex);
+    if (v < 4)
+        return (int)v;
 
-    if (memcmp(&tid, &__zero_tid, sizeof(pthread_t)) != 0)
-        pthread_join(tid, NULL);
+    e = 63 - __builtin_clzll(v);
+    if (e > 40)
+        return THRDPOOL_HIST_BUCKETS - 1;
 
-    return NULL;
+    return 4 * (e - 1) + (int)((v >> (e - 2)) & 3);
 }
 
-static void __thrdpool_terminate(int in_pool, thrdpool_t* pool)
+static pthread_t __zero_tid;
+
+/* Entries are recycled through a per-thread cache. A worker's cache fills
+ * up with the entries it dequeues and hands them to a shared depot one
+ * batch at a time; producers refill from the depot, so malloc is reached
+ * only when the depot runs dry. */
+#define THRDPOOL_CACHE_BATCH 128
+#define THRDPOOL_DEPOT_MAX 64
+
+struct __thrdpool_free_entry
 {
-    pthread_cond_t term = PTHREAD_COND_INITIALIZER;
+    struct __thrdpool_free_entry* next;
+    struct __thrdpool_free_entry* next_batch;
+    size_t count;
+};
 
-    pthread_mutex_lock(&pool->mutex);
-    msgqueue_set_nonblock(pool->msgqueue);
-    pool->terminate = &term;
+struct __thrdpool_cache
+{
+    struct __thrdpool_free_entry* head;
+    size_t count;
+    int registered;
+    int node; // depot slot; pinned workers use their NUMA node
+};
 
-    if (in_pool)
-    {
-        pthread_detach(pthread_self());
-        pool->nthreads--;
-    }
+static __thread struct __thrdpool_cache __cache;
+static struct __thrdpool_free_entry* __depot[THRDPOOL_NODE_MAX];
+static size_t __depot_cnt[THRDPOOL_NODE_MAX];
+static pthread_mutex_t __depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t __cache_key;
+static pthread_once_t __cache_once = PTHREAD_ONCE_INIT;
 
-    while (pool->nthreads > 0)
+/* Batches are kept per NUMA node, so a pinned worker reuses entries last
+ * touched on its own node instead of pulling remote ones. */
+static void __thrdpool_depot_put(
+    struct __thrdpool_free_entry* batch, size_t count, int node)
+{
+    struct __thrdpool_free_entry* next;
+
+    batch->count = count;
+    pthread_mutex_lock(&__depot_mutex);
+    if (__depot_cnt[node] < THRDPOOL_DEPOT_MAX)
     {
-        pthread_cond_wait(&term, &pool->mutex);
+        batch->next_batch = __depot[node];
+        __depot[node] = batch;
+        __depot_cnt[node]++;
+        batch = NULL;
     }
 
-    pthread_mutex_unlock(&pool->mutex);
-    if (memcpy(&pool->tid, &__zero_tid, sizeof(pthread_t)) != 0)
+    pthread_mutex_unlock(&__depot_mutex);
+    while (batch)
     {
-        pthread_join(pool->tid, NULL);
+        next = batch->next;
+        free(batch);
+        batch = next;
     }
 }
 
-static int __thrdpool_create_threads(size_t nthreads, thrdpool_t* pool)
+static void __thrdpool_cache_flush(void* arg)
 {
-    pthread_attr_t attr;
-    pthread_t tid;
-    int ret;
+    struct __thrdpool_cache* cache = (struct __thrdpool_cache*)arg;
 
-    ret = pthread_attr_init(&attr);
-    if (ret == 0)
+    if (cache->head)
+        __thrdpool_depot_put(cache->head, cache->count, cache->node);
+
+    cache->head = NULL;
+    cache->count = 0;
+}
+
+static void __thrdpool_cache_init(void)
+{
+    pthread_key_create(&__cache_key, __thrdpool_cache_flush);
+}
+
+// Make sure the cache goes back to the depot when this thread exits.
+static void __thrdpool_cache_register(struct __thrdpool_cache* cache)
+{
+    pthread_once(&__cache_once, __thrdpool_cache_init);
+    pthread_setspecific(__cache_key, cache);
+    cache->registered = 1;
+}
+
+static struct thrdpool_task_entry* __thrdpool_entry_alloc(void)
+{
+    struct __thrdpool_cache* cache = &__cache;
+    struct __thrdpool_free_entry* entry = cache->head;
+
+    if (!entry)
     {
-        if (pool->stacksize)
+        pthread_mutex_lock(&__depot_mutex);
+        entry = __depot[cache->node];
+        if (entry)
         {
-            pthread_attr_setstacksize(&attr, pool->stacksize);
+            __depot[cache->node] = entry->next_batch;
+            __depot_cnt[cache->node]--;
         }
-        while (pool->nthreads < nthreads)
+
+        pthread_mutex_unlock(&__depot_mutex);
+        if (!entry)
         {
-            ret = pthread_create(&tid, &attr, __thrdpool_routine, pool);
-            if (ret == 0)
-            {
-                pool->nthreads++;
-            }
-            else
-            {
-                break;
-            }
+            return (struct thrdpool_task_entry*)malloc(
+                sizeof(struct thrdpool_task_entry));
         }
-        pthread_attr_destroy(&attr);
 
-        if (pool->nthreads == nthreads)
-            return 0;
+        if (!cache->registered)
+            __thrdpool_cache_register(cache);
 
-        __thrdpool_terminate(0, pool);
+        cache->count = entry->count;
     }
 
-    errno = ret;
-    return -1;
+    cache->head = entry->next;
+    cache->count--;
+    return (struct thrdpool_task_entry*)entry;
 }
 
-thrdpool_t* thrdpool_create(size_t nthreads, size_t stacksize)
+static void __thrdpool_entry_free(struct thrdpool_task_entry* entry)
 {
-    thrdpool_t* pool;
-    int ret;
+    struct __thrdpool_cache* cache = &__cache;
+    struct __thrdpool_free_entry* node;
+
+    if (entry->flags & THRDPOOL_ENTRY_INPLACE)
+        return;
 
-    pool = (thrdpool_t*)malloc(sizeof(thrdpool_t));
-    if (!pool)
+    if (!cache->registered)
+        __thrdpool_cache_register(cache);
+
+    if (cache->count == THRDPOOL_CACHE_BATCH)
     {
-        return NULL;
+        __thrdpool_depot_put(cache->head, cache->count, cache->node);
+        cache->head = NULL;
+        cache->count = 0;
     }
-    pool->msgqueue = msgqueue_create(0, 0);
-    if (pool->msgqueue)
+
+    node = (struct __thrdpool_free_entry*)entry;
+    node->next = cache->head;
+    cache->head = node;
+    cache->count++;
+}
+
+// Take an entry behind a handle off the queue. 0 if it was canceled.
+static int __thrdpool_entry_claim(struct thrdpool_task_entry* entry)
+{
+    int flags = __atomic_fetch_or(&entry->flags, THRDPOOL_ENTRY_STARTED,
+                                  __ATOMIC_ACQ_REL);
+
+    if (flags & THRDPOOL_ENTRY_RELEASED)
+        __thrdpool_entry_free(entry);
+
+    return !(flags & THRDPOOL_ENTRY_CANCELED);
+}
+
+#define THRDPOOL_STACK_CACHE 64 // most idle stacks kept per process
+#define THRDPOOL_LAZY_STACK (256 * 1024) // lazy pools' default stacksize
+
+/* Worker and coroutine stacks that are no longer in use, kept for any
+ * pool in the process to reuse. A stack is a mapping with its guard page
+ * at the bottom. The pages of a cached stack go back to the kernel on the
+ * way in, so the cache holds address space but no memory; the list node
+ * sits in the lowest usable page. */
+struct __thrdpool_stack
+{
+    struct __thrdpool_stack* next;
+    size_t size;
+};
+
+static pthread_mutex_t __stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct __thrdpool_stack* __stack_cache;
+static size_t __stack_cnt;
+
+// Mapping size, guard page included, for size bytes of usable stack.
+static size_t __thrdpool_stack_bytes(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page + page;
+}
+
+static char* __thrdpool_stack_get(size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    struct __thrdpool_stack** pp;
+    struct __thrdpool_stack* node = NULL;
+    void* stack;
+
+    pthread_mutex_lock(&__stack_mutex);
+    for (pp = &__stack_cache; *pp; pp = &(*pp)->next)
     {
-        ret = pthread_mutex_init(&pool->mutex, NULL);
-        if (ret == 0)
+        if ((*pp)->size == bytes)
         {
-            // thread local value
-            ret = pthread_key_create(&pool->key, NULL);
-            if (ret == 0)
-            {
-                pool->stacksize = stacksize;
-                pool->nthreads = 0;
-                memset(&pool->tid, 0, sizeof(pthread_t));
-                pool->terminate = NULL;
-                if (__thrdpool_create_threads(nthreads, pool) >= 0)
-                {
-                    return pool;
-                }
-                pthread_key_delete(pool->key);
-            }
-            pthread_mutex_destroy(&pool->mutex);
+            node = *pp;
+            *pp = node->next;
+            __stack_cnt--;
+            break;
         }
-
-        errno = ret;
-        msgqueue_destory(pool->msgqueue);
     }
 
-    free(pool);
-    return NULL;
-}
+    pthread_mutex_unlock(&__stack_mutex);
+    if (node)
+        return (char*)node - page;
 
-inline void __thrdpool_schedule(
-    const struct thrdpool_task* task, void* buf, thrdpool_t* pool);
+    stack = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        return NULL;
 
-void __thrdpool_schedule(
-    const struct thrdpool_task* task, void* buf, thrdpool_t* pool)
+    // Overflow faults on the guard page instead of running into a neighbour.
+    mprotect(stack, page, PROT_NONE);
+    return (char*)stack;
+}
+
+// Only once nothing runs on the stack any more.
+static void __thrdpool_stack_put(char* stack, size_t bytes)
 {
-    ((struct __thrdpool_task_entry*)buf)->task = *task;
-    msgqueue_put(buf, pool->msgqueue);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    struct __thrdpool_stack* node = (struct __thrdpool_stack*)(stack + page);
+
+    madvise(stack + page, bytes - page, MADV_DONTNEED);
+    pthread_mutex_lock(&__stack_mutex);
+    if (__stack_cnt < THRDPOOL_STACK_CACHE)
+    {
+        node->next = __stack_cache;
+        node->size = bytes;
+        __stack_cache = node;
+        __stack_cnt++;
+        stack = NULL;
+    }
+
+    pthread_mutex_unlock(&__stack_mutex);
+    if (stack)
+        munmap(stack, bytes);
 }
 
-int thrdpool_schedule(const struct thrdpool_task* task, thrdpool_t* pool)
+static int __thrdpool_add_worker(thrdpool_t* pool);
+
+/* Every worker is busy. Add one if enough work is waiting. A lazy pool
+ * with no worker yet always gets one: a worker can only fail to grow the
+ * pool when a running one will see the work anyway. */
+static void __thrdpool_grow(thrdpool_t* pool)
 {
-    void* buf = malloc(sizeof(struct __thrdpool_task_entry));
-    if (buf)
+    size_t backlog = 0;
+    int first = __atomic_load_n(&pool->nthreads, __ATOMIC_RELAXED) == 0;
+    int i;
+
+    for (i = 0; i < pool->nqueues; i++)
+        backlog += __atomic_load_n(&pool->lanes[i].cnt, __ATOMIC_RELAXED);
+
+    if (backlog < pool->grow_backlog && !first)
+        return;
+
+    if (first)
+        pthread_mutex_lock(&pool->mutex);
+
+    if (first || pthread_mutex_trylock(&pool->mutex) == 0)
     {
-        __thrdpool_schedule(task, buf, pool);
-        return 0;
+        if (!pool->terminate && pool->nthreads < pool->max_threads)
+            __thrdpool_add_worker(pool);
+
+        pthread_mutex_unlock(&pool->mutex);
     }
-    return -1;
 }
 
-int thrdpool_increase(thrdpool_t* pool)
+static void __thrdpool_wake(size_t n, thrdpool_t* pool);
+
+// Every worker of a shard is busy; an idle neighbour can pull the work.
+static void __thrdpool_wake_peers(thrdpool_t* pool)
 {
-    pthread_attr_t attr;
-    pthread_t tid;
-    int ret;
+    thrdpool_t* peer;
+    int i;
 
-    ret = pthread_attr_init(&attr);
-    if (ret == 0)
+    for (i = 0; i < 2; i++)
     {
-        if (pool->stacksize)
+        peer = __atomic_load_n(&pool->peers[i], __ATOMIC_ACQUIRE);
+        if (peer && __atomic_load_n(&peer->idle, __ATOMIC_RELAXED) > 0)
         {
-            pthread_attr_setstacksize(&attr, pool->stacksize);
+            __thrdpool_wake(1, peer);
+            return;
         }
+    }
+}
 
-        pthread_mutex_lock(&pool->mutex);
+static void __thrdpool_wake(size_t n, thrdpool_t* pool)
+{
+    int idle;
+    int k;
 
-        ret = pthread_create(&tid, &attr, __thrdpool_routine, pool);
+    // Pairs with the fences in __thrdpool_get_entry() and __thrdpool_park():
+    // either the worker's next scan sees the new entry, or we see it idle
+    // or still holding a token.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    idle = __atomic_load_n(&pool->idle, __ATOMIC_RELAXED);
+    if (idle == 0)
+    {
+        if (pool->nthreads < pool->max_threads)
+            __thrdpool_grow(pool);
 
-        if (ret == 0)
+        if (pool->peers[0])
+            __thrdpool_wake_peers(pool);
+
+        return;
+    }
+
+    if ((size_t)idle > n)
+        idle = (int)n;
+
+    if (__atomic_load_n(&pool->signals, __ATOMIC_RELAXED) >= idle)
+        return;
+
+    pthread_mutex_lock(&pool->park_mutex);
+    k = idle - pool->signals;
+
+    if (k > 0)
+    {
+        // A spinning worker picks the token up without a wakeup.
+        pool->signals += k;
+        if (pool->parked > 0)
         {
-            pool->nthreads++;
+            TRACE_POINT(TRACE_WAKE, pool, k);
+            if (k == 1)
+                pthread_cond_signal(&pool->park_cond);
+            else
+                pthread_cond_broadcast(&pool->park_cond);
         }
-
-        pthread_mutex_unlock(&pool->mutex);
-        pthread_attr_destroy(&attr);
-        if (ret == 0)
-            return 0;
     }
 
-    errno = ret;
-    return -1;
+    pthread_mutex_unlock(&pool->park_mutex);
 }
 
-int thrdpool_in_pool(thrdpool_t* pool)
+// The node whose lanes a task scheduled by the calling thread goes to.
+static int __thrdpool_node(thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker;
+    int cpu;
+
+    if (pool->nnodes == 1)
+        return 0;
+
+    worker = (struct __thrdpool_worker*)pthread_getspecific(pool->key);
+    if (worker)
+        return worker->node;
+
+    cpu = sched_getcpu();
+    if (cpu < 0)
+        return 0;
+
+    if (cpu < pool->ncpu_map && pool->cpu_map[cpu] >= 0)
+        return pool->cpu_map[cpu];
+
+    return cpu % pool->nnodes;
+}
+
+static void __thrdpool_put(void* entry, int prio, thrdpool_t* pool)
 {
-    return pthread_getspecific(pool->key) == pool;
+    struct __thrdpool_lane* lane;
+
+    lane = &pool->lanes[__thrdpool_node(pool) * pool->nlanes + prio];
+    msgqueue_put(entry, lane->queue);
+    if (pool->counted)
+        __atomic_fetch_add(&lane->cnt, 1, __ATOMIC_RELAXED);
+
+    __thrdpool_wake(1, pool);
 }
 
-void thrdpool_destory(
-    void (*pending)(const struct thrdpool_task*), thrdpool_t* pool)
+/* Whether n more tasks at prio would take the caller's lane past
+ * queue_max. Checked before queueing, so racing producers may overshoot
+ * it a little. */
+static int __thrdpool_full(int prio, size_t n, thrdpool_t* pool)
 {
-    int in_pool = thrdpool_in_pool(pool);
+    struct __thrdpool_lane* lane;
+    int cnt;
+
+    if (pool->queue_max == 0)
+        return 0;
+
+    lane = &pool->lanes[__thrdpool_node(pool) * pool->nlanes + prio];
+    cnt = __atomic_load_n(&lane->cnt, __ATOMIC_RELAXED);
+    if ((size_t)cnt + n <= pool->queue_max)
+        return 0;
+
+    errno = EAGAIN;
+    return 1;
+}
+
+static void* __thrdpool_get_lane(struct __thrdpool_lane* lane,
+                                 thrdpool_t* pool)
+{
+    void* entry;
+
+    if (!pool->counted)
+        return msgqueue_get(lane->queue);
+
+    if (__atomic_load_n(&lane->cnt, __ATOMIC_RELAXED) == 0)
+        return NULL;
 
-    struct __thrdpool_task_entry* entry;
+    entry = msgqueue_get(lane->queue);
+    if (entry)
+        __atomic_fetch_sub(&lane->cnt, 1, __ATOMIC_RELAXED);
 
-    __thrdpool_terminate(in_pool, pool);
+    return entry;
+}
+
+// Own node first, then the others, at one priority level.
+static void* __thrdpool_get_prio(int prio, struct __thrdpool_worker* worker)
+{
+    thrdpool_t* pool = worker->pool;
+    void* entry = NULL;
+    int node = worker->node;
+    int i;
 
-    while (1)
+    for (i = 0; i < pool->nnodes && !entry; i++)
     {
-        entry = (struct __thrdpool_task_entry*)msgqueue_get(pool->msgqueue);
-        if (!entry)
+        entry = __thrdpool_get_lane(&pool->lanes[node * pool->nlanes + prio],
+                                    pool);
+        if (++node == pool->nnodes)
+            node = 0;
+    }
+
+    return entry;
+}
+
+static void* __thrdpool_get_lanes(struct __thrdpool_worker* worker)
+{
+    thrdpool_t* pool = worker->pool;
+    void* entry = NULL;
+    int i;
+
+    // Every starvation_limit-th dequeue looks at the lowest lane first, so
+    // background lanes still progress under a steady urgent load.
+    if (pool->starvation_limit > 0 &&
+        ++worker->ticks % (unsigned int)pool->starvation_limit == 0)
+    {
+        for (i = pool->nlanes - 1; i >= 0 && !entry; i--)
+            entry = __thrdpool_get_prio(i, worker);
+    }
+    else
+    {
+        for (i = 0; i < pool->nlanes && !entry; i++)
+            entry = __thrdpool_get_prio(i, worker);
+    }
+
+    return entry;
+}
+
+/* Spin for a wake token first, then sleep. Same adaptive budget as msgqueue.
+ * Returns -1 if idle_timeout passed without a token. */
+static int __thrdpool_park(struct __thrdpool_worker* worker)
+{
+    thrdpool_t* pool = worker->pool;
+    int limit = 2 * worker->spin_avg + 16;
+    struct timespec abstime;
+    int ret = 0;
+    int i;
+
+    if (limit > pool->spin)
+        limit = pool->spin;
+
+    __thrdpool_stat_add(&worker->stats.parks, 1);
+    for (i = 0; i < limit; i++)
+    {
+        if (__atomic_load_n(&pool->signals, __ATOMIC_RELAXED) > 0 ||
+            pool->terminate)
+        {
+            worker->spin_avg += (i - worker->spin_avg) / 8;
             break;
-        if (pending)
+        }
+
+        THRDPOOL_CPU_RELAX();
+    }
+
+    if (i == limit)
+        worker->spin_avg -= worker->spin_avg / 8;
+
+    if (pool->idle_timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &abstime);
+        abstime.tv_sec += pool->idle_timeout / 1000;
+        abstime.tv_nsec += pool->idle_timeout % 1000 * 1000000;
+        if (abstime.tv_nsec >= 1000000000)
         {
-            pending(&entry->task);
+            abstime.tv_nsec -= 1000000000;
+            abstime.tv_sec++;
         }
-        free(entry);
     }
 
-    pthread_key_delete(pool->key);
-    pthread_mutex_destroy(&pool->mutex);
-    msgqueue_destory(pool->msgqueue);
-    if (!in_pool)
+    TRACE_POINT(TRACE_PARK_BEGIN, pool, 0);
+    pthread_mutex_lock(&pool->park_mutex);
+    while (pool->signals == 0 && !pool->terminate && ret != ETIMEDOUT)
     {
-        free(pool);
+        __thrdpool_stat_add(&worker->stats.sleeps, 1);
+        pool->parked++;
+        if (pool->idle_timeout > 0)
+        {
+            ret = pthread_cond_timedwait(&pool->park_cond, &pool->park_mutex,
+                                         &abstime);
+        }
+        else
+            pthread_cond_wait(&pool->park_cond, &pool->park_mutex);
+
+        pool->parked--;
+    }
+
+    if (pool->signals > 0)
+    {
+        pool->signals--;
+        ret = 0;
     }
-}
\ No newline at end of file
+
+    pthread_mutex_unlock(&pool->park_mutex);
+    TRACE_POINT(TRACE_PARK_END, pool, 0);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return ret == ETIMEDOUT ? -1 : 0;
+}
+
+/* Leave a running pool: the same join chain as at termination, keeping at
+ * least min_threads workers (one if forced, as by thrdpool_decrease()). */
+static int __thrdpool_retire(struct __thrdpool_worker* worker, int force)
+{
+    thrdpool_t* pool = worker->pool;
+    size_t floor = force || pool->min_threads == 0 ? 1 : pool->min_threads;
+    struct thrdpool_task_entry* runnext;
+    char* stack;
+    pthread_t tid;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->terminate || pool->nthreads <= floor)
+    {
+        pthread_mutex_unlock(&pool->mutex);
+        return 0;
+    }
+
+    // The slot's next thread must not take our stack; whoever joins us
+    // gives it back.
+    tid = pool->tid;
+    stack = pool->tid_stack;
+    pool->tid = pthread_self();
+    pool->tid_stack = worker->stack;
+    worker->stack = NULL;
+    runnext = worker->runnext;
+    worker->runnext = NULL;
+    pool->nthreads--;
+    worker->retired = 1;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (memcmp(&tid, &__zero_tid, sizeof(pthread_t)) != 0)
+        pthread_join(tid, NULL);
+
+    if (stack)
+        __thrdpool_stack_put(stack, pool->stack_bytes);
+
+    // Only a decrease retires a worker with a task set aside for it.
+    if (runnext)
+        __thrdpool_put(runnext, 0, pool);
+
+    return 1;
+}
+
+// Steal from peers on the same node first, then from anyone.
+static void* __thrdpool_steal(struct __thrdpool_worker* worker)
+{
+    struct __thrdpool_worker* victim;
+    void* entry;
+    int pass;
+
+    for (pass = worker->pool->nnodes > 1 ? 0 : 1; pass < 2; pass++)
+    {
+        victim = __atomic_load_n(&worker->next, __ATOMIC_ACQUIRE);
+        while (victim != worker)
+        {
+            if (victim->deque && (pass == 1 || victim->node == worker->node))
+            {
+                entry = wsdeque_steal(victim->deque);
+                if (entry)
+                {
+                    __thrdpool_stat_add(&worker->stats.steals, 1);
+                    return entry;
+                }
+            }
+
+            victim = __atomic_load_n(&victim->next, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return NULL;
+}
+
+/* Give a pulled entry back to the tail of its lane. Only an idle worker
+ * of the owner needs waking; waking its neighbours could wake the puller
+ * again for the same entry. */
+static void __thrdpool_unpull(void* entry, struct __thrdpool_lane* lane,
+                              thrdpool_t* pool)
+{
+    msgqueue_put(entry, lane->queue);
+    if (pool->counted)
+        __atomic_fetch_add(&lane->cnt, 1, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0)
+        __thrdpool_wake(1, pool);
+}
+
+/* Take from a neighbouring shard with no idle worker of its own, most
+ * urgent lane first. Shards always count their lanes, so an empty one
+ * costs a load. */
+static void* __thrdpool_pull(struct __thrdpool_worker* worker)
+{
+    struct thrdpool_task_entry* entry;
+    thrdpool_t* peer;
+    int i;
+    int j;
+
+    for (i = 0; i < 2; i++)
+    {
+        peer = __atomic_load_n(&worker->pool->peers[i], __ATOMIC_ACQUIRE);
+        if (!peer || __atomic_load_n(&peer->idle, __ATOMIC_RELAXED) > 0)
+            continue;
+
+        for (j = 0; j < peer->nqueues; j++)
+        {
+            entry = (struct thrdpool_task_entry*)__thrdpool_get_lane(
+                &peer->lanes[j], peer);
+            if (entry && !(entry->flags & THRDPOOL_ENTRY_LOCAL))
+                return entry;
+
+            if (entry)
+                __thrdpool_unpull(entry, &peer->lanes[j], peer);
+        }
+    }
+
+    return NULL;
+}
+
+static void* __thrdpool_edf_get(int late, thrdpool_t* pool);
+
+// Deadline tasks first, and those demoted for being late last of all.
+static void* __thrdpool_find_entry(struct __thrdpool_worker* worker)
+{
+    void* entry = __thrdpool_edf_get(0, worker->pool);
+
+    if (!entry && worker->pool->deque_size)
+        entry = __thrdpool_steal(worker);
+
+    if (!entry)
+        entry = __thrdpool_get_lanes(worker);
+
+    if (!entry && worker->pool->peers[0])
+        entry = __thrdpool_pull(worker);
+
+    if (!entry)
+        entry = __thrdpool_edf_get(1, worker->pool);
+
+    return entry;
+}
+
+/* Returned by __thrdpool_get_entry() to a worker that has retired. Its slot
+ * may be reused at once, so the worker must not look at it again. */
+static struct thrdpool_task_entry __thrdpool_retired;
+
+static struct thrdpool_task_entry* __thrdpool_get_entry(
+    struct __thrdpool_worker* worker)
+{
+    thrdpool_t* pool = worker->pool;
+    void* entry = worker->runnext;
+
+    if (entry)
+    {
+        worker->runnext = NULL;
+        return (struct thrdpool_task_entry*)entry;
+    }
+
+    if (worker->deque)
+    {
+        entry = wsdeque_pop(worker->deque);
+        if (entry)
+            return (struct thrdpool_task_entry*)entry;
+    }
+
+    entry = __thrdpool_find_entry(worker);
+    if (entry)
+        return (struct thrdpool_task_entry*)entry;
+
+    // Announce idleness before the last look around. Pairs with the fence
+    // in __thrdpool_wake() and __thrdpool_schedule().
+    __atomic_fetch_add(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    entry = __thrdpool_find_entry(worker);
+    if (!entry)
+    {
+        do
+        {
+            if (pool->terminate)
+                break;
+
+            if (__thrdpool_park(worker) < 0)
+            {
+                __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                if (__thrdpool_retire(worker, 0))
+                    return &__thrdpool_retired;
+
+                __atomic_fetch_add(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            }
+        } while (!(entry = __thrdpool_find_entry(worker)));
+
+        // More work may be behind this one; let another idle worker look.
+        if (entry)
+        {
+            __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            __thrdpool_wake(1, pool);
+            return (struct thrdpool_task_entry*)entry;
+        }
+    }
+
+    __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_RELAXED);
+    return (struct thrdpool_task_entry*)entry;
+}
+
+static void __thrdpool_group_done(struct __thrdpool_group* group);
+
+// From __thrdpool_run() for a canceled entry, which is left out of stats.
+#define THRDPOOL_SKIPPED (~0ULL)
+
+/* Run a dequeued entry. Returns the start time for __thrdpool_account(),
+ * which must not be called if the task destroyed the pool. */
+static unsigned long long __thrdpool_run(struct thrdpool_task_entry* entry,
+                                         struct __thrdpool_worker* worker)
+{
+    void (*task_routine)(void*) = entry->task.routine;
+    void* task_context = entry->task.context;
+    struct __thrdpool_group* group = entry->group;
+    unsigned long long stamp = entry->stamp;
+    unsigned long long start = 0;
+
+    if (!(entry->flags & THRDPOOL_ENTRY_HANDLE))
+        __thrdpool_entry_free(entry);
+    else if (!__thrdpool_entry_claim(entry))
+        return THRDPOOL_SKIPPED;
+
+    if (worker->pool->stats)
+    {
+        start = __thrdpool_now();
+        __thrdpool_stat_add(&worker->stats.wait_hist[
+            __thrdpool_hist_bucket(start - stamp)], 1);
+    }
+
+    TRACE_POINT(TRACE_TASK_BEGIN, task_routine, 0);
+    task_routine(task_context);
+    TRACE_POINT(TRACE_TASK_END, task_routine, 0);
+    if (group)
+        __thrdpool_group_done(group);
+
+    return start;
+}
+
+static void __thrdpool_account(unsigned long long start,
+                               struct __thrdpool_worker* worker)
+{
+    if (start == THRDPOOL_SKIPPED)
+        return;
+
+    __thrdpool_stat_add(&worker->stats.tasks, 1);
+    if (worker->pool->stats)
+    {
+        __thrdpool_stat_add(&worker->stats.run_hist[
+            __thrdpool_hist_bucket(__thrdpool_now() - start)], 1);
+    }
+}
+
+static void* __thrdpool_routine(void* arg)
+{
+    struct __thrdpool_worker* worker = (struct __thrdpool_worker*)arg;
+    thrdpool_t* pool = worker->pool;
+    struct thrdpool_task_entry* entry;
+    unsigned long long start;
+
+    pthread_setspecific(pool->key, worker);
+    __cache.node = worker->node;
+    while (!pool->terminate || __atomic_load_n(&pool->drain, __ATOMIC_RELAXED))
+    {
+        entry = __thrdpool_get_entry(worker);
+        if (entry == &__thrdpool_retired)
+            return NULL;
+
+        if (!entry)
+            break;
+
+        start = __thrdpool_run(entry, worker);
+
+        // The task may have destroyed the pool, worker slots included.
+        if (pool->nthreads == 0)
+        {
+            free(pool);
+            return NULL;
+        }
+
+        __thrdpool_account(start, worker);
+
+        if (worker->exiting && __thrdpool_retire(worker, 1))
+            return NULL;
+
+        worker->exiting = 0;
+    }
+
+    // The terminating thread joins every slot, so all exit at once.
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->nthreads == 0)
+        pthread_cond_signal(pool->terminate);
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* With drain, workers run until nothing is queued anywhere, ms at most if
+ * ms >= 0; then, or without drain, each exits after its current task.
+ * Returns 1 if the deadline cut a drain short. Workers retired earlier
+ * are on the pool->tid chain; the rest are joined from their slots. */
+static int __thrdpool_terminate(int in_pool, int drain, long long ms,
+                                thrdpool_t* pool)
+{
+    pthread_cond_t term = PTHREAD_COND_INITIALIZER;
+    struct __thrdpool_worker* worker;
+    struct timespec abstime;
+    int timedout = 0;
+
+    if (drain && ms >= 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &abstime);
+        abstime.tv_sec += ms / 1000;
+        abstime.tv_nsec += ms % 1000 * 1000000;
+        if (abstime.tv_nsec >= 1000000000)
+        {
+            abstime.tv_nsec -= 1000000000;
+            abstime.tv_sec++;
+        }
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&pool->drain, drain, __ATOMIC_RELAXED);
+    pool->terminate = &term;
+    pthread_mutex_lock(&pool->park_mutex);
+    pthread_cond_broadcast(&pool->park_cond);
+    pthread_mutex_unlock(&pool->park_mutex);
+
+    if (in_pool)
+    {
+        pthread_detach(pthread_self());
+        pool->nthreads--;
+    }
+
+    while (pool->nthreads > 0)
+    {
+        if (pool->drain && ms >= 0)
+        {
+            if (pthread_cond_clockwait(&term, &pool->mutex, CLOCK_MONOTONIC,
+                                       &abstime) == ETIMEDOUT)
+            {
+                __atomic_store_n(&pool->drain, 0, __ATOMIC_RELAXED);
+                timedout = 1;
+            }
+        }
+        else
+            pthread_cond_wait(&term, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    if (memcmp(&pool->tid, &__zero_tid, sizeof(pthread_t)) != 0)
+    {
+        pthread_join(pool->tid, NULL);
+        if (pool->tid_stack)
+            __thrdpool_stack_put(pool->tid_stack, pool->stack_bytes);
+
+        pool->tid_stack = NULL;
+    }
+
+    // A worker destroying its own pool is still on its stack, which is
+    // left to it for good.
+    worker = pool->workers;
+    while (worker)
+    {
+        if (!worker->retired && !pthread_equal(worker->tid, pthread_self()))
+        {
+            pthread_join(worker->tid, NULL);
+            if (worker->stack)
+                __thrdpool_stack_put(worker->stack, pool->stack_bytes);
+        }
+
+        worker->stack = NULL;
+        worker = worker->next != pool->workers ? worker->next : NULL;
+    }
+
+    return timedout;
+}
+
+// Called with pool->mutex held, or before the pool is published.
+static struct __thrdpool_worker* __thrdpool_new_slot(thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker;
+    size_t i;
+
+    if (posix_memalign((void**)&worker, THRDPOOL_CACHELINE,
+                       sizeof(*worker)) != 0)
+        return NULL;
+
+    memset(&worker->stats, 0, sizeof(worker->stats));
+
+    worker->pool = pool;
+    worker->next = worker;
+    worker->index = pool->nslots;
+    worker->node = 0;
+    worker->deque = NULL;
+    if (pool->cpu_nodes)
+    {
+        i = worker->index % pool->ncpus;
+        worker->node = pool->cpu_nodes[i];
+    }
+
+    if (pool->deque_size)
+    {
+        worker->deque = wsdeque_create(pool->deque_size);
+        if (!worker->deque)
+        {
+            free(worker);
+            return NULL;
+        }
+    }
+
+    return worker;
+}
+
+// Called with pool->mutex held, or before the pool is published.
+static int __thrdpool_create_worker(pthread_attr_t* attr, thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker = pool->workers;
+    cpu_set_t cpuset;
+    size_t page;
+    int fresh = 0;
+    int ret = 0;
+
+    // A retired worker's thread no longer touches its slot.
+    while (worker && !worker->retired)
+    {
+        worker = worker->next;
+        if (worker == pool->workers)
+            worker = NULL;
+    }
+
+    if (!worker)
+    {
+        worker = __thrdpool_new_slot(pool);
+        if (!worker)
+            return ENOMEM;
+
+        fresh = 1;
+    }
+
+    worker->retired = 0;
+    worker->exiting = 0;
+    worker->ticks = 0;
+    worker->spin_avg = 0;
+    worker->depth = 0;
+    worker->runnext = NULL;
+    worker->stack = NULL;
+    if (pool->cpus)
+    {
+        CPU_ZERO(&cpuset);
+        CPU_SET(pool->cpus[worker->index % pool->ncpus], &cpuset);
+        ret = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpuset);
+    }
+
+    if (ret == 0 && pool->stack_bytes)
+    {
+        worker->stack = __thrdpool_stack_get(pool->stack_bytes);
+        if (!worker->stack)
+            ret = ENOMEM;
+        else
+        {
+            page = (size_t)sysconf(_SC_PAGESIZE);
+            ret = pthread_attr_setstack(attr, worker->stack + page,
+                                        pool->stack_bytes - page);
+        }
+    }
+
+    /* Counted first: from an empty lazy pool, the new worker could finish
+     * a task and take a zero count for a destroyed pool. */
+    pool->nthreads++;
+    if (ret == 0)
+        ret = pthread_create(&worker->tid, attr, __thrdpool_routine, worker);
+
+    if (ret == 0)
+    {
+        if (fresh && pool->workers)
+        {
+            __atomic_store_n(&worker->next, pool->workers->next,
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&pool->workers->next, worker, __ATOMIC_RELEASE);
+        }
+        else if (fresh)
+            pool->workers = worker;
+
+        pool->nslots += fresh;
+        return 0;
+    }
+
+    pool->nthreads--;
+    worker->retired = 1;
+    if (worker->stack)
+        __thrdpool_stack_put(worker->stack, pool->stack_bytes);
+
+    worker->stack = NULL;
+    if (fresh)
+    {
+        if (worker->deque)
+            wsdeque_destory(worker->deque);
+
+        free(worker);
+    }
+
+    return ret;
+}
+
+// Called with pool->mutex held.
+static int __thrdpool_add_worker(thrdpool_t* pool)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    ret = pthread_attr_init(&attr);
+    if (ret == 0)
+    {
+        if (pool->stacksize)
+        {
+            pthread_attr_setstacksize(&attr, pool->stacksize);
+        }
+
+        ret = __thrdpool_create_worker(&attr, pool);
+        pthread_attr_destroy(&attr);
+    }
+
+    return ret;
+}
+
+static int __thrdpool_create_threads(size_t nthreads, thrdpool_t* pool)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    ret = pthread_attr_init(&attr);
+    if (ret == 0)
+    {
+        if (pool->stacksize)
+        {
+            pthread_attr_setstacksize(&attr, pool->stacksize);
+        }
+        while (pool->nthreads < nthreads)
+        {
+            ret = __thrdpool_create_worker(&attr, pool);
+            if (ret != 0)
+                break;
+        }
+        pthread_attr_destroy(&attr);
+
+        if (pool->nthreads == nthreads)
+            return 0;
+
+        __thrdpool_terminate(0, 0, -1, pool);
+    }
+
+    errno = ret;
+    return -1;
+}
+
+static void __thrdpool_drop_entry(struct thrdpool_task_entry* entry,
+                                  void (*pending)(const struct thrdpool_task*));
+
+// Only after every worker has exited. Hands locally queued tasks to pending.
+static void __thrdpool_free_workers(
+    void (*pending)(const struct thrdpool_task*), thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker = pool->workers;
+    struct __thrdpool_worker* next;
+    struct thrdpool_task_entry* entry;
+
+    while (worker)
+    {
+        if (worker->runnext)
+            __thrdpool_drop_entry(worker->runnext, pending);
+
+        if (worker->deque)
+        {
+            while ((entry = wsdeque_pop(worker->deque)) != NULL)
+                __thrdpool_drop_entry(entry, pending);
+
+            wsdeque_destory(worker->deque);
+        }
+
+        next = worker->next;
+        free(worker);
+        worker = next != pool->workers ? next : NULL;
+    }
+
+    pool->workers = NULL;
+}
+
+static void __thrdpool_destroy_placement(thrdpool_t* pool)
+{
+    free(pool->cpus);
+    free(pool->cpu_nodes);
+    free(pool->cpu_map);
+}
+
+// Keep our own copy of the cpu list and build the cpu -> node map.
+static int __thrdpool_create_placement(
+    const struct thrdpool_params* params, thrdpool_t* pool)
+{
+    size_t i;
+    int cpu;
+
+    pool->cpus = NULL;
+    pool->cpu_nodes = NULL;
+    pool->cpu_map = NULL;
+    pool->ncpus = 0;
+    pool->ncpu_map = 0;
+    pool->nnodes = 1;
+    if (!params->cpus || params->ncpus == 0)
+        return 0;
+
+    for (i = 0; i < params->ncpus; i++)
+    {
+        cpu = params->cpus[i];
+        if (cpu < 0 || cpu >= CPU_SETSIZE || (params->cpu_nodes &&
+            (params->cpu_nodes[i] < 0 ||
+             params->cpu_nodes[i] >= THRDPOOL_NODE_MAX)))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (cpu >= pool->ncpu_map)
+            pool->ncpu_map = cpu + 1;
+
+        if (params->cpu_nodes && params->cpu_nodes[i] >= pool->nnodes)
+            pool->nnodes = params->cpu_nodes[i] + 1;
+    }
+
+    pool->ncpus = params->ncpus;
+    pool->cpus = (int*)malloc(pool->ncpus * sizeof(int));
+    pool->cpu_map = (int*)malloc(pool->ncpu_map * sizeof(int));
+    if (params->cpu_nodes)
+        pool->cpu_nodes = (int*)malloc(pool->ncpus * sizeof(int));
+
+    if (pool->cpus && pool->cpu_map && (pool->cpu_nodes || !params->cpu_nodes))
+    {
+        memcpy(pool->cpus, params->cpus, pool->ncpus * sizeof(int));
+        for (cpu = 0; cpu < pool->ncpu_map; cpu++)
+            pool->cpu_map[cpu] = -1;
+
+        for (i = 0; i < pool->ncpus; i++)
+        {
+            cpu = pool->cpus[i];
+            pool->cpu_map[cpu] = params->cpu_nodes ? params->cpu_nodes[i] : 0;
+            if (pool->cpu_nodes)
+                pool->cpu_nodes[i] = params->cpu_nodes[i];
+        }
+
+        return 0;
+    }
+
+    __thrdpool_destroy_placement(pool);
+    errno = ENOMEM;
+    return -1;
+}
+
+static void __thrdpool_destroy_lanes(thrdpool_t* pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nqueues; i++)
+        msgqueue_destory(pool->lanes[i].queue);
+
+    free(pool->lanes);
+}
+
+static int __thrdpool_create_lanes(
+    const struct thrdpool_params* params, thrdpool_t* pool)
+{
+    int nlanes = params->prio_levels;
+    int nqueues;
+
+    if (nlanes < 1)
+        nlanes = 1;
+    else if (nlanes > THRDPOOL_PRIO_MAX)
+        nlanes = THRDPOOL_PRIO_MAX;
+
+    nqueues = nlanes * pool->nnodes;
+    pool->nlanes = nlanes;
+    if (posix_memalign((void**)&pool->lanes, THRDPOOL_CACHELINE,
+                       nqueues * sizeof(struct __thrdpool_lane)) != 0)
+        return -1;
+
+    for (pool->nqueues = 0; pool->nqueues < nqueues; pool->nqueues++)
+    {
+        pool->lanes[pool->nqueues].queue =
+            msgqueue_create_ex(0, 0, params->msgqueue_flags);
+        if (!pool->lanes[pool->nqueues].queue)
+        {
+            __thrdpool_destroy_lanes(pool);
+            return -1;
+        }
+
+        msgqueue_set_nonblock(pool->lanes[pool->nqueues].queue);
+        pool->lanes[pool->nqueues].cnt = 0;
+    }
+
+    return 0;
+}
+
+// Timed parking measures idle_timeout on the monotonic clock.
+static int __thrdpool_init_park_cond(thrdpool_t* pool)
+{
+    pthread_condattr_t attr;
+    int ret;
+
+    ret = pthread_condattr_init(&attr);
+    if (ret == 0)
+    {
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        ret = pthread_cond_init(&pool->park_cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    return ret;
+}
+
+thrdpool_t* thrdpool_create(size_t nthreads, size_t stacksize)
+{
+    struct thrdpool_params params = THRDPOOL_PARAMS_DEFAULT;
+
+    params.nthreads = nthreads;
+    params.stacksize = stacksize;
+    return thrdpool_create_ex(&params);
+}
+
+// A shard keeps lane counts even when it needs none itself.
+static thrdpool_t* __thrdpool_create(const struct thrdpool_params* params,
+                                     int shard)
+{
+    size_t nthreads = params->lazy ? params->min_threads : params->nthreads;
+    thrdpool_t* pool;
+    int ret;
+
+    if (posix_memalign((void**)&pool, THRDPOOL_CACHELINE,
+                       sizeof(thrdpool_t)) != 0)
+    {
+        return NULL;
+    }
+    if (__thrdpool_create_placement(params, pool) < 0)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    if (__thrdpool_create_lanes(params, pool) >= 0)
+    {
+        ret = pthread_mutex_init(&pool->mutex, NULL);
+        if (ret == 0)
+        {
+            ret = pthread_mutex_init(&pool->park_mutex, NULL);
+            if (ret == 0)
+            {
+                ret = __thrdpool_init_park_cond(pool);
+                if (ret == 0)
+                {
+                    // thread local value
+                    ret = pthread_key_create(&pool->key, NULL);
+                    if (ret == 0)
+                    {
+                        pool->max_threads = params->max_threads;
+                        if (params->lazy &&
+                            pool->max_threads < params->nthreads)
+                        {
+                            pool->max_threads = params->nthreads;
+                        }
+
+                        pool->min_threads = params->min_threads;
+                        pool->grow_backlog = params->grow_backlog;
+                        pool->idle_timeout = params->idle_timeout;
+                        pool->queue_max = params->queue_max;
+                        pool->counted = shard || pool->nqueues > 1 ||
+                                        pool->max_threads > nthreads ||
+                                        pool->queue_max > 0;
+                        pool->nslots = 0;
+                        pool->starvation_limit = params->starvation_limit;
+                        pool->stacksize = params->stacksize;
+                        if (params->lazy && pool->stacksize == 0)
+                            pool->stacksize = THRDPOOL_LAZY_STACK;
+
+                        pool->stack_bytes = 0;
+                        if (pool->stacksize)
+                        {
+                            pool->stack_bytes =
+                                __thrdpool_stack_bytes(pool->stacksize);
+                        }
+
+                        pool->tid_stack = NULL;
+                        pool->deque_size = params->deque_size;
+                        pool->spin = params->spin;
+                        pool->stats = params->stats;
+                        pool->idle = 0;
+                        pool->parked = 0;
+                        pool->signals = 0;
+                        pool->workers = NULL;
+                        pool->nthreads = 0;
+                        memset(&pool->tid, 0, sizeof(pthread_t));
+                        pool->terminate = NULL;
+                        pool->drain = 0;
+                        pool->timers = NULL;
+                        pool->coros = NULL;
+                        pool->edf = NULL;
+                        pool->deadline_policy = THRDPOOL_DEADLINE_RUN;
+                        pool->late = NULL;
+                        pool->late_context = NULL;
+                        pool->peers[0] = NULL;
+                        pool->peers[1] = NULL;
+                        pool->coroutine_stacksize =
+                            params->coroutine_stacksize;
+                        pool->stage_max = params->stage_max;
+                        pool->stage_timeout = params->stage_timeout > 0 ?
+                                              params->stage_timeout : 1;
+                        pool->stage_ready = 0;
+                        pool->inline_depth = params->inline_depth;
+                        pool->stages = NULL;
+                        if (__thrdpool_create_threads(nthreads, pool) >= 0)
+                        {
+                            return pool;
+                        }
+                        __thrdpool_free_workers(NULL, pool);
+                        pthread_key_delete(pool->key);
+                    }
+                    pthread_cond_destroy(&pool->park_cond);
+                }
+                pthread_mutex_destroy(&pool->park_mutex);
+            }
+            pthread_mutex_destroy(&pool->mutex);
+        }
+
+        errno = ret;
+        __thrdpool_destroy_lanes(pool);
+    }
+
+    __thrdpool_destroy_placement(pool);
+    free(pool);
+    return NULL;
+}
+
+thrdpool_t* thrdpool_create_ex(const struct thrdpool_params* params)
+{
+    return __thrdpool_create(params, 0);
+}
+
+inline void __thrdpool_schedule(
+    const struct thrdpool_task* task, void* buf, thrdpool_t* pool);
+
+void __thrdpool_schedule(
+    const struct thrdpool_task* task, void* buf, thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker;
+
+    ((struct thrdpool_task_entry*)buf)->task = *task;
+    if (pool->stats)
+        ((struct thrdpool_task_entry*)buf)->stamp = __thrdpool_now();
+
+    if (pool->deque_size)
+    {
+        worker = (struct __thrdpool_worker*)pthread_getspecific(pool->key);
+        if (worker && wsdeque_push(buf, worker->deque) == 0)
+        {
+            // Keep the continuation local unless some worker is idle, in
+            // which case move one back to the shared queue to wake it.
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&pool->idle, __ATOMIC_RELAXED) == 0)
+                return;
+
+            buf = wsdeque_pop(worker->deque);
+            if (!buf)
+                return;
+        }
+    }
+
+    __thrdpool_put(buf, 0, pool);
+}
+
+/* One per thread that schedules into a pool with stage_max set. The owner
+ * takes the mutex on every call but only it and the flush timer ever do,
+ * so it stays uncontended; the lane's put_mutex is taken once per flush.
+ * A thread's list outlives it and is handed to the next thread that needs
+ * one. */
+struct __thrdpool_stage
+{
+    pthread_mutex_t mutex;
+    thrdpool_t* pool;
+    struct thrdpool_task_entry* head;
+    struct thrdpool_task_entry* tail;
+    size_t cnt;
+    int node;
+    int owned;
+    thrdpool_timer_t* timer; // armed flush timer, or NULL
+    struct __thrdpool_stage* next;
+} __attribute__((aligned(THRDPOOL_CACHELINE)));
+
+// Called with stage->mutex held.
+static void __thrdpool_stage_flush(struct __thrdpool_stage* stage)
+{
+    thrdpool_t* pool = stage->pool;
+    struct __thrdpool_lane* lane = &pool->lanes[stage->node * pool->nlanes];
+    size_t n = stage->cnt;
+
+    if (n == 0)
+        return;
+
+    msgqueue_put_list(stage->head, stage->tail, n, lane->queue);
+    if (pool->counted)
+        __atomic_fetch_add(&lane->cnt, (int)n, __ATOMIC_RELAXED);
+
+    stage->head = NULL;
+    stage->tail = NULL;
+    stage->cnt = 0;
+    __thrdpool_wake(n, pool);
+}
+
+static void __thrdpool_stage_timeout(void* context)
+{
+    struct __thrdpool_stage* stage = (struct __thrdpool_stage*)context;
+
+    pthread_mutex_lock(&stage->mutex);
+    // NULL if destroy got here first and already released the timer.
+    if (stage->timer)
+    {
+        thrdpool_timer_cancel(stage->timer);
+        stage->timer = NULL;
+    }
+
+    __thrdpool_stage_flush(stage);
+    pthread_mutex_unlock(&stage->mutex);
+}
+
+// Thread exit: hand the rest over and free the list for another thread.
+static void __thrdpool_stage_exit(void* arg)
+{
+    struct __thrdpool_stage* stage = (struct __thrdpool_stage*)arg;
+
+    pthread_mutex_lock(&stage->mutex);
+    __thrdpool_stage_flush(stage);
+    __atomic_store_n(&stage->owned, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stage->mutex);
+}
+
+static struct __thrdpool_stage* __thrdpool_new_stage(thrdpool_t* pool)
+{
+    struct __thrdpool_stage* stage;
+
+    if (posix_memalign((void**)&stage, THRDPOOL_CACHELINE,
+                       sizeof(struct __thrdpool_stage)) != 0)
+    {
+        return NULL;
+    }
+    if (pthread_mutex_init(&stage->mutex, NULL) != 0)
+    {
+        free(stage);
+        return NULL;
+    }
+
+    stage->pool = pool;
+    stage->head = NULL;
+    stage->tail = NULL;
+    stage->cnt = 0;
+    stage->timer = NULL;
+    stage->owned = 0;
+    stage->next = pool->stages;
+    pool->stages = stage;
+    return stage;
+}
+
+static struct __thrdpool_stage* __thrdpool_get_stage(thrdpool_t* pool)
+{
+    struct __thrdpool_stage* stage;
+
+    if (__atomic_load_n(&pool->stage_ready, __ATOMIC_ACQUIRE))
+    {
+        stage = (struct __thrdpool_stage*)pthread_getspecific(
+            pool->stage_key);
+        if (stage)
+            return stage;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->stage_ready &&
+        pthread_key_create(&pool->stage_key, __thrdpool_stage_exit) == 0)
+    {
+        __atomic_store_n(&pool->stage_ready, 1, __ATOMIC_RELEASE);
+    }
+
+    stage = NULL;
+    if (pool->stage_ready)
+    {
+        for (stage = pool->stages; stage; stage = stage->next)
+        {
+            if (!__atomic_load_n(&stage->owned, __ATOMIC_ACQUIRE))
+                break;
+        }
+
+        if (!stage)
+            stage = __thrdpool_new_stage(pool);
+
+        if (stage && pthread_setspecific(pool->stage_key, stage) == 0)
+        {
+            pthread_mutex_lock(&stage->mutex);
+            stage->owned = 1;
+            stage->node = __thrdpool_node(pool);
+            pthread_mutex_unlock(&stage->mutex);
+        }
+        else
+            stage = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return stage;
+}
+
+/* Returns -1 to have the caller queue the entry directly: from a worker
+ * with a deque, which has a cheaper local path, or when out of memory. */
+static int __thrdpool_stage(const struct thrdpool_task* task,
+                            struct thrdpool_task_entry* entry,
+                            thrdpool_t* pool)
+{
+    struct __thrdpool_stage* stage;
+    struct thrdpool_task timeout;
+
+    if (pool->deque_size && pthread_getspecific(pool->key))
+        return -1;
+
+    stage = __thrdpool_get_stage(pool);
+    if (!stage)
+        return -1;
+
+    entry->task = *task;
+    if (pool->stats)
+        entry->stamp = __thrdpool_now();
+
+    entry->link = NULL;
+    pthread_mutex_lock(&stage->mutex);
+    if (stage->tail)
+        stage->tail->link = &entry->link;
+    else
+        stage->head = entry;
+
+    stage->tail = entry;
+    if (++stage->cnt >= pool->stage_max)
+        __thrdpool_stage_flush(stage);
+    else if (!stage->timer)
+    {
+        // The first staged entry starts the clock on the whole list.
+        timeout.routine = __thrdpool_stage_timeout;
+        timeout.context = stage;
+        if (thrdpool_schedule_after(&timeout, pool->stage_timeout,
+                                    &stage->timer, pool) < 0)
+        {
+            stage->timer = NULL;
+            __thrdpool_stage_flush(stage);
+        }
+    }
+
+    pthread_mutex_unlock(&stage->mutex);
+    return 0;
+}
+
+void thrdpool_flush(thrdpool_t* pool)
+{
+    struct __thrdpool_stage* stage;
+
+    if (!__atomic_load_n(&pool->stage_ready, __ATOMIC_ACQUIRE))
+        return;
+
+    stage = (struct __thrdpool_stage*)pthread_getspecific(pool->stage_key);
+    if (stage)
+    {
+        pthread_mutex_lock(&stage->mutex);
+        __thrdpool_stage_flush(stage);
+        pthread_mutex_unlock(&stage->mutex);
+    }
+}
+
+static int __thrdpool_edf_waiting(thrdpool_t* pool);
+
+/* The calling worker, if it may keep a task to itself: nothing else is
+ * waiting in the lanes, the deadline heap or the worker's own deque and
+ * run-next slot, so running it here rather than queueing it delays no one
+ * and keeps the caller's submission order. */
+static struct __thrdpool_worker* __thrdpool_inline_worker(thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker;
+    int i;
+
+    worker = (struct __thrdpool_worker*)pthread_getspecific(pool->key);
+    if (!worker || worker->runnext ||
+        (worker->deque && wsdeque_size(worker->deque) > 0))
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < pool->nqueues; i++)
+    {
+        if (pool->counted ?
+            __atomic_load_n(&pool->lanes[i].cnt, __ATOMIC_RELAXED) > 0 :
+            msgqueue_size(pool->lanes[i].queue) > 0)
+        {
+            return NULL;
+        }
+    }
+
+    return __thrdpool_edf_waiting(pool) ? NULL : worker;
+}
+
+int thrdpool_schedule(const struct thrdpool_task* task, thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker = NULL;
+    struct thrdpool_task_entry* entry;
+    unsigned long long start = 0;
+
+    if (pool->inline_depth > 0)
+    {
+        /* Not from a coroutine: one that switches out inside the task
+         * would hold this worker's depth up meanwhile, and might finish
+         * on another worker. */
+        worker = __thrdpool_inline_worker(pool);
+        if (worker && worker->depth < pool->inline_depth &&
+            !thrdpool_coroutine_self())
+        {
+            // Counted like a dequeued task, with no wait.
+            if (pool->stats)
+            {
+                start = __thrdpool_now();
+                __thrdpool_stat_add(&worker->stats.wait_hist[
+                    __thrdpool_hist_bucket(0)], 1);
+            }
+
+            worker->depth++;
+            TRACE_POINT(TRACE_TASK_BEGIN, task->routine, 0);
+            task->routine(task->context);
+            TRACE_POINT(TRACE_TASK_END, task->routine, 0);
+            worker->depth--;
+            __thrdpool_account(start, worker);
+            return 0;
+        }
+    }
+
+    if (__thrdpool_full(0, 1, pool))
+        return -1;
+
+    entry = __thrdpool_entry_alloc();
+    if (entry)
+    {
+        entry->flags = 0;
+        entry->group = NULL;
+        // Too deep to run inline: next in line for this worker instead.
+        if (worker)
+        {
+            entry->task = *task;
+            if (pool->stats)
+                entry->stamp = __thrdpool_now();
+
+            worker->runnext = entry;
+        }
+        else if (pool->stage_max == 0 ||
+                 __thrdpool_stage(task, entry, pool) < 0)
+            __thrdpool_schedule(task, entry, pool);
+
+        return 0;
+    }
+    return -1;
+}
+
+int thrdpool_schedule_prio(
+    const struct thrdpool_task* task, int prio, thrdpool_t* pool)
+{
+    struct thrdpool_task_entry* entry;
+
+    if (prio <= 0)
+        return thrdpool_schedule(task, pool);
+
+    if (prio >= pool->nlanes)
+        prio = pool->nlanes - 1;
+
+    if (__thrdpool_full(prio, 1, pool))
+        return -1;
+
+    entry = __thrdpool_entry_alloc();
+    if (entry)
+    {
+        entry->flags = 0;
+        entry->group = NULL;
+        entry->task = *task;
+        if (pool->stats)
+            entry->stamp = __thrdpool_now();
+
+        __thrdpool_put(entry, prio, pool);
+        return 0;
+    }
+    return -1;
+}
+
+int thrdpool_schedule_cancelable(const struct thrdpool_task* task,
+                                 thrdpool_handle_t** handle,
+                                 thrdpool_t* pool)
+{
+    struct thrdpool_task_entry* entry;
+
+    if (__thrdpool_full(0, 1, pool))
+        return -1;
+
+    entry = __thrdpool_entry_alloc();
+    if (!entry)
+        return -1;
+
+    entry->flags = THRDPOOL_ENTRY_HANDLE;
+    entry->group = NULL;
+    *handle = (thrdpool_handle_t*)entry;
+    __thrdpool_schedule(task, entry, pool);
+    return 0;
+}
+
+int thrdpool_cancel(thrdpool_handle_t* handle)
+{
+    struct thrdpool_task_entry* entry = (struct thrdpool_task_entry*)handle;
+    int flags = __atomic_fetch_or(&entry->flags, THRDPOOL_ENTRY_CANCELED,
+                                  __ATOMIC_ACQ_REL);
+
+    return !(flags & (THRDPOOL_ENTRY_STARTED | THRDPOOL_ENTRY_CANCELED));
+}
+
+void thrdpool_handle_release(thrdpool_handle_t* handle)
+{
+    struct thrdpool_task_entry* entry = (struct thrdpool_task_entry*)handle;
+    int flags = __atomic_fetch_or(&entry->flags, THRDPOOL_ENTRY_RELEASED,
+                                  __ATOMIC_ACQ_REL);
+
+    if (flags & THRDPOOL_ENTRY_STARTED)
+        __thrdpool_entry_free(entry);
+}
+
+void thrdpool_schedule_inplace(const struct thrdpool_task* task,
+                               struct thrdpool_task_entry* entry,
+                               thrdpool_t* pool)
+{
+    entry->flags = THRDPOOL_ENTRY_INPLACE;
+    entry->group = NULL;
+    __thrdpool_schedule(task, entry, pool);
+}
+
+int thrdpool_schedule_batch(
+    const struct thrdpool_task* tasks, size_t n, thrdpool_t* pool)
+{
+    struct thrdpool_task_entry* head = NULL;
+    struct thrdpool_task_entry* tail = NULL;
+    struct thrdpool_task_entry* entry;
+    struct __thrdpool_lane* lane;
+    unsigned long long stamp = 0;
+    size_t i;
+
+    if (n == 0)
+        return 0;
+
+    if (__thrdpool_full(0, n, pool))
+        return -1;
+
+    if (pool->stats)
+        stamp = __thrdpool_now();
+
+    for (i = 0; i < n; i++)
+    {
+        entry = __thrdpool_entry_alloc();
+        if (!entry)
+            break;
+
+        entry->flags = 0;
+        entry->group = NULL;
+        entry->task = tasks[i];
+        entry->stamp = stamp;
+        if (tail)
+            tail->link = &entry->link;
+        else
+            head = entry;
+
+        tail = entry;
+    }
+
+    if (i == n)
+    {
+        lane = &pool->lanes[__thrdpool_node(pool) * pool->nlanes];
+        msgqueue_put_list(head, tail, n, lane->queue);
+        if (pool->counted)
+            __atomic_fetch_add(&lane->cnt, (int)n, __ATOMIC_RELAXED);
+
+        __thrdpool_wake(n, pool);
+        return 0;
+    }
+
+    while (head != tail)
+    {
+        entry = head;
+        head = (struct thrdpool_task_entry*)head->link;
+        __thrdpool_entry_free(entry);
+    }
+
+    if (tail)
+        __thrdpool_entry_free(tail);
+
+    return -1;
+}
+
+int thrdpool_increase(thrdpool_t* pool)
+{
+    int ret;
+
+    pthread_mutex_lock(&pool->mutex);
+    ret = __thrdpool_add_worker(pool);
+    pthread_mutex_unlock(&pool->mutex);
+    if (ret == 0)
+        return 0;
+
+    errno = ret;
+    return -1;
+}
+
+static void __thrdpool_exit_routine(void* context)
+{
+    thrdpool_t* pool = (thrdpool_t*)context;
+    struct __thrdpool_worker* worker;
+
+    // A LOCAL entry is not pulled, but should a worker of another pool
+    // still get here, pass the exit on to one of this pool's own.
+    worker = (struct __thrdpool_worker*)pthread_getspecific(pool->key);
+    if (worker)
+        worker->exiting = 1;
+    else
+        thrdpool_decrease(pool);
+}
+
+int thrdpool_decrease(thrdpool_t* pool)
+{
+    struct thrdpool_task_entry* entry;
+    int prio = pool->nlanes - 1;
+
+    if (pool->nthreads <= 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (__thrdpool_full(prio, 1, pool))
+        return -1;
+
+    entry = __thrdpool_entry_alloc();
+    if (!entry)
+        return -1;
+
+    entry->flags = THRDPOOL_ENTRY_LOCAL;
+    entry->group = NULL;
+    entry->task.routine = __thrdpool_exit_routine;
+    entry->task.context = pool;
+    if (pool->stats)
+        entry->stamp = __thrdpool_now();
+
+    // The least urgent lane, so queued work is not kept waiting.
+    __thrdpool_put(entry, prio, pool);
+    return 0;
+}
+
+// Run one queued task on the calling worker. 0 if there was none.
+static int __thrdpool_help(struct __thrdpool_worker* worker)
+{
+    struct thrdpool_task_entry* entry = worker->runnext;
+
+    if (entry)
+        worker->runnext = NULL;
+    else if (worker->deque)
+        entry = (struct thrdpool_task_entry*)wsdeque_pop(worker->deque);
+
+    if (!entry)
+        entry = (struct thrdpool_task_entry*)__thrdpool_find_entry(worker);
+
+    if (!entry)
+        return 0;
+
+    __thrdpool_account(__thrdpool_run(entry, worker), worker);
+    return 1;
+}
+
+static void __thrdpool_group_done(struct __thrdpool_group* group)
+{
+    size_t n = __atomic_load_n(&group->pending, __ATOMIC_RELAXED);
+
+    while (n > 1)
+    {
+        if (__atomic_compare_exchange_n(&group->pending, &n, n - 1, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return;
+    }
+
+    thrdpool_t* pool = group->pool;
+    struct thrdpool_task done = {
+        .routine = NULL,
+        .context = NULL,
+    };
+
+    pthread_mutex_lock(&group->mutex);
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        done = group->done;
+        if (group->waiters > 0)
+            pthread_cond_broadcast(&group->cond);
+    }
+
+    pthread_mutex_unlock(&group->mutex);
+
+    // The group may be gone by now; done is allowed to destroy it.
+    if (done.routine && thrdpool_schedule(&done, pool) < 0)
+        done.routine(done.context);
+}
+
+thrdpool_group_t* thrdpool_group_create(const struct thrdpool_task* done,
+                                        thrdpool_t* pool)
+{
+    thrdpool_group_t* group;
+    pthread_condattr_t attr;
+    int ret;
+
+    group = (thrdpool_group_t*)malloc(sizeof(thrdpool_group_t));
+    if (!group)
+        return NULL;
+
+    ret = pthread_mutex_init(&group->mutex, NULL);
+    if (ret == 0)
+    {
+        ret = pthread_condattr_init(&attr);
+        if (ret == 0)
+        {
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            ret = pthread_cond_init(&group->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            if (ret == 0)
+            {
+                group->pool = pool;
+                group->pending = 1;
+                group->waiters = 0;
+                group->done.routine = NULL;
+                group->done.context = NULL;
+                if (done)
+                    group->done = *done;
+
+                return group;
+            }
+        }
+
+        pthread_mutex_destroy(&group->mutex);
+    }
+
+    errno = ret;
+    free(group);
+    return NULL;
+}
+
+int thrdpool_group_schedule(const struct thrdpool_task* task,
+                            thrdpool_group_t* group)
+{
+    thrdpool_t* pool = group->pool;
+    struct thrdpool_task_entry* entry;
+
+    if (__thrdpool_full(0, 1, pool))
+        return -1;
+
+    entry = __thrdpool_entry_alloc();
+    if (!entry)
+        return -1;
+
+    __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+    entry->flags = 0;
+    entry->group = group;
+    __thrdpool_schedule(task, entry, pool);
+    return 0;
+}
+
+/* A worker helps instead of blocking. When nothing is queued it sleeps a
+ * millisecond at a time, so tasks queued after it looked, which another
+ * waiting worker might otherwise be the only one left to run, still get
+ * picked up. */
+void thrdpool_group_wait(thrdpool_group_t* group)
+{
+    struct __thrdpool_worker* worker;
+    struct timespec abstime;
+
+    worker = (struct __thrdpool_worker*)pthread_getspecific(
+        group->pool->key);
+    __thrdpool_group_done(group);
+    pthread_mutex_lock(&group->mutex);
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0)
+    {
+        if (worker)
+        {
+            pthread_mutex_unlock(&group->mutex);
+            if (__thrdpool_help(worker))
+            {
+                pthread_mutex_lock(&group->mutex);
+                continue;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &abstime);
+            abstime.tv_nsec += 1000000;
+            if (abstime.tv_nsec >= 1000000000)
+            {
+                abstime.tv_nsec -= 1000000000;
+                abstime.tv_sec++;
+            }
+
+            pthread_mutex_lock(&group->mutex);
+            if (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) == 0)
+                break;
+
+            group->waiters++;
+            pthread_cond_timedwait(&group->cond, &group->mutex, &abstime);
+            group->waiters--;
+        }
+        else
+        {
+            group->waiters++;
+            pthread_cond_wait(&group->cond, &group->mutex);
+            group->waiters--;
+        }
+    }
+
+    // Open again for the next round.
+    __atomic_store_n(&group->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void thrdpool_group_close(thrdpool_group_t* group)
+{
+    __thrdpool_group_done(group);
+}
+
+void thrdpool_group_destory(thrdpool_group_t* group)
+{
+    pthread_cond_destroy(&group->cond);
+    pthread_mutex_destroy(&group->mutex);
+    free(group);
+}
+
+#define THRDPOOL_PARALLEL_SPLIT 8
+#define THRDPOOL_PARALLEL_PROBE 16
+#define THRDPOOL_PARALLEL_TARGET 50000 // ns per chunk with automatic grain
+
+/* A parallel loop cuts [begin, end) into nchunks chunks of grain indices
+ * and runs as a tree: a task owning chunks [first, last) schedules the
+ * upper half through the group, where an idle worker can steal it, and
+ * keeps splitting the lower half down to one chunk. Each split takes the
+ * next free slot of ranges, so the loop needs no allocation per task. */
+struct __thrdpool_parallel
+{
+    thrdpool_group_t* group;
+    size_t begin;
+    size_t end;
+    size_t grain;
+    void (*fn)(size_t, size_t, void*);
+    void (*reduce)(size_t, size_t, void*, void*);
+    char* accs;
+    size_t size;
+    void* context;
+    struct __thrdpool_range* ranges;
+    size_t next;
+};
+
+struct __thrdpool_range
+{
+    struct __thrdpool_parallel* parallel;
+    size_t first;
+    size_t last;
+};
+
+static void __thrdpool_range_routine(void* context)
+{
+    struct __thrdpool_range* range = (struct __thrdpool_range*)context;
+    struct __thrdpool_parallel* parallel = range->parallel;
+    size_t first = range->first;
+    size_t last = range->last;
+    struct __thrdpool_range* upper;
+    struct thrdpool_task task;
+    size_t begin;
+    size_t end;
+
+    while (last - first > 1)
+    {
+        upper = &parallel->ranges[
+            __atomic_fetch_add(&parallel->next, 1, __ATOMIC_RELAXED)];
+        upper->parallel = parallel;
+        upper->first = first + (last - first) / 2;
+        upper->last = last;
+        task.routine = __thrdpool_range_routine;
+        task.context = upper;
+        if (thrdpool_group_schedule(&task, parallel->group) < 0)
+            __thrdpool_range_routine(upper);
+
+        last = upper->first;
+    }
+
+    begin = parallel->begin + first * parallel->grain;
+    end = parallel->end - begin > parallel->grain ?
+          begin + parallel->grain : parallel->end;
+    if (parallel->reduce)
+    {
+        parallel->reduce(begin, end, parallel->accs + first * parallel->size,
+                         parallel->context);
+    }
+    else
+        parallel->fn(begin, end, parallel->context);
+}
+
+// Run a probe chunk on the caller and size chunks from how long it took.
+static void __thrdpool_parallel_probe(struct __thrdpool_parallel* parallel,
+                                      void* result, thrdpool_t* pool)
+{
+    size_t n = parallel->end - parallel->begin;
+    size_t probe = n < THRDPOOL_PARALLEL_PROBE ? n : THRDPOOL_PARALLEL_PROBE;
+    unsigned long long start = __thrdpool_now();
+    unsigned long long per;
+    size_t grain;
+    size_t min;
+
+    if (parallel->reduce)
+    {
+        parallel->reduce(parallel->begin, parallel->begin + probe, result,
+                         parallel->context);
+    }
+    else
+        parallel->fn(parallel->begin, parallel->begin + probe,
+                     parallel->context);
+
+    per = (__thrdpool_now() - start) / probe;
+    parallel->begin += probe;
+    n -= probe;
+    grain = per ? THRDPOOL_PARALLEL_TARGET / per : n;
+    // Never more than a few chunks per worker.
+    min = n / (__atomic_load_n(&pool->nthreads, __ATOMIC_RELAXED) *
+               THRDPOOL_PARALLEL_SPLIT + 1) + 1;
+    parallel->grain = grain > min ? grain : min;
+}
+
+static int __thrdpool_parallel(struct __thrdpool_parallel* parallel,
+                               void* result,
+                               void (*init)(void*, void*),
+                               void (*join)(void*, const void*, void*),
+                               thrdpool_t* pool)
+{
+    struct __thrdpool_range* root;
+    size_t nchunks;
+    size_t i;
+
+    if (parallel->grain == 0)
+        __thrdpool_parallel_probe(parallel, result, pool);
+
+    if (parallel->begin == parallel->end)
+        return 0;
+
+    nchunks = (parallel->end - parallel->begin - 1) / parallel->grain + 1;
+    parallel->ranges = (struct __thrdpool_range*)malloc(
+        nchunks * sizeof(struct __thrdpool_range));
+    if (!parallel->ranges)
+        return -1;
+
+    if (parallel->reduce)
+    {
+        parallel->accs = (char*)malloc(nchunks * parallel->size);
+        if (!parallel->accs)
+        {
+            free(parallel->ranges);
+            return -1;
+        }
+
+        for (i = 0; i < nchunks; i++)
+            init(parallel->accs + i * parallel->size, parallel->context);
+    }
+
+    parallel->group = thrdpool_group_create(NULL, pool);
+    if (!parallel->group)
+    {
+        free(parallel->accs);
+        free(parallel->ranges);
+        return -1;
+    }
+
+    // The caller runs the root itself, so it never waits on a full pool.
+    parallel->next = 1;
+    root = &parallel->ranges[0];
+    root->parallel = parallel;
+    root->first = 0;
+    root->last = nchunks;
+    __thrdpool_range_routine(root);
+    thrdpool_group_wait(parallel->group);
+    thrdpool_group_destory(parallel->group);
+
+    if (parallel->reduce)
+    {
+        // In index order, so join need not be commutative.
+        for (i = 0; i < nchunks; i++)
+            join(result, parallel->accs + i * parallel->size,
+                 parallel->context);
+
+        free(parallel->accs);
+    }
+
+    free(parallel->ranges);
+    return 0;
+}
+
+int thrdpool_parallel_for(thrdpool_t* pool, size_t begin, size_t end,
+                          size_t grain,
+                          void (*fn)(size_t, size_t, void*), void* context)
+{
+    struct __thrdpool_parallel parallel = {
+        .begin = begin,
+        .end = end,
+        .grain = grain,
+        .fn = fn,
+        .context = context,
+    };
+
+    if (begin >= end)
+        return 0;
+
+    return __thrdpool_parallel(&parallel, NULL, NULL, NULL, pool);
+}
+
+int thrdpool_parallel_reduce(thrdpool_t* pool, size_t begin, size_t end,
+                             size_t grain, void* result, size_t size,
+                             void (*init)(void*, void*),
+                             void (*fn)(size_t, size_t, void*, void*),
+                             void (*join)(void*, const void*, void*),
+                             void* context)
+{
+    struct __thrdpool_parallel parallel = {
+        .begin = begin,
+        .end = end,
+        .grain = grain,
+        .reduce = fn,
+        .size = size,
+        .context = context,
+    };
+
+    init(result, context);
+    if (begin >= end)
+        return 0;
+
+    return __thrdpool_parallel(&parallel, result, init, join, pool);
+}
+
+/* Deadline tasks sit in one pairing heap per pool, created with the first
+ * of them, and workers look there before their lanes. Tasks found late
+ * under THRDPOOL_DEADLINE_DEMOTE move to a FIFO that is served only once
+ * the lanes are empty too. */
+struct __thrdpool_edf
+{
+    pthread_mutex_t mutex;
+    struct __thrdpool_edf_node* root;
+    struct __thrdpool_edf_node* late_head;
+    struct __thrdpool_edf_node* late_tail;
+    size_t heap_cnt; // read without the lock to skip an empty heap
+    size_t late_cnt;
+};
+
+struct __thrdpool_edf_node
+{
+    struct thrdpool_task_entry entry; // runs __thrdpool_edf_run
+    struct thrdpool_task task;
+    thrdpool_t* pool;
+    unsigned long long deadline;
+    struct __thrdpool_edf_node* child;
+    struct __thrdpool_edf_node* sibling; // or next in the late FIFO
+    int late;
+};
+
+static struct __thrdpool_edf* __thrdpool_get_edf(thrdpool_t* pool)
+{
+    struct __thrdpool_edf* edf;
+
+    edf = __atomic_load_n(&pool->edf, __ATOMIC_ACQUIRE);
+    if (!edf)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        edf = pool->edf;
+        if (!edf)
+        {
+            edf = (struct __thrdpool_edf*)malloc(sizeof(struct __thrdpool_edf));
+            if (edf && pthread_mutex_init(&edf->mutex, NULL) == 0)
+            {
+                edf->root = NULL;
+                edf->late_head = NULL;
+                edf->late_tail = NULL;
+                edf->heap_cnt = 0;
+                edf->late_cnt = 0;
+                __atomic_store_n(&pool->edf, edf, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                free(edf);
+                edf = NULL;
+            }
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return edf;
+}
+
+static struct __thrdpool_edf_node* __thrdpool_edf_meld(
+    struct __thrdpool_edf_node* a, struct __thrdpool_edf_node* b)
+{
+    struct __thrdpool_edf_node* t;
+
+    if (!a)
+        return b;
+
+    if (!b)
+        return a;
+
+    if (b->deadline < a->deadline)
+    {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    b->sibling = a->child;
+    a->child = b;
+    return a;
+}
+
+// The usual two passes: meld pairs left to right, then the results back.
+static struct __thrdpool_edf_node* __thrdpool_edf_merge(
+    struct __thrdpool_edf_node* first)
+{
+    struct __thrdpool_edf_node* pairs = NULL;
+    struct __thrdpool_edf_node* root = NULL;
+    struct __thrdpool_edf_node* a;
+    struct __thrdpool_edf_node* b;
+
+    while (first)
+    {
+        a = first;
+        b = a->sibling;
+        first = b ? b->sibling : NULL;
+        a->sibling = NULL;
+        if (b)
+        {
+            b->sibling = NULL;
+            a = __thrdpool_edf_meld(a, b);
+        }
+
+        a->sibling = pairs;
+        pairs = a;
+    }
+
+    while (pairs)
+    {
+        a = pairs;
+        pairs = a->sibling;
+        a->sibling = NULL;
+        root = __thrdpool_edf_meld(root, a);
+    }
+
+    return root;
+}
+
+// Called with edf->mutex held.
+static struct __thrdpool_edf_node* __thrdpool_edf_pop(
+    struct __thrdpool_edf* edf)
+{
+    struct __thrdpool_edf_node* node = edf->root;
+
+    if (node)
+    {
+        edf->root = __thrdpool_edf_merge(node->child);
+        __atomic_store_n(&edf->heap_cnt, edf->heap_cnt - 1,
+                         __ATOMIC_RELAXED);
+    }
+
+    return node;
+}
+
+/* Earliest deadline first, or with late set, the oldest demoted task.
+ * Finding late tasks costs one clock read per call, and only under a
+ * policy other than THRDPOOL_DEADLINE_RUN. */
+static void* __thrdpool_edf_get(int late, thrdpool_t* pool)
+{
+    struct __thrdpool_edf* edf = __atomic_load_n(&pool->edf,
+                                                 __ATOMIC_ACQUIRE);
+    struct __thrdpool_edf_node* node;
+    unsigned long long now = 0;
+
+    if (!edf || __atomic_load_n(late ? &edf->late_cnt : &edf->heap_cnt,
+                                __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
+
+    if (pool->deadline_policy != THRDPOOL_DEADLINE_RUN)
+        now = __thrdpool_now();
+
+    pthread_mutex_lock(&edf->mutex);
+    if (late)
+    {
+        node = edf->late_head;
+        if (node)
+        {
+            edf->late_head = node->sibling;
+            __atomic_store_n(&edf->late_cnt, edf->late_cnt - 1,
+                             __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        while ((node = __thrdpool_edf_pop(edf)) != NULL)
+        {
+            if (now == 0 || node->deadline >= now)
+                break;
+
+            if (pool->deadline_policy == THRDPOOL_DEADLINE_DROP)
+            {
+                node->late = 1;
+                break;
+            }
+
+            node->sibling = NULL;
+            if (edf->late_head)
+                edf->late_tail->sibling = node;
+            else
+                edf->late_head = node;
+
+            edf->late_tail = node;
+            __atomic_store_n(&edf->late_cnt, edf->late_cnt + 1,
+                             __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&edf->mutex);
+    return node ? &node->entry : NULL;
+}
+
+static int __thrdpool_edf_waiting(thrdpool_t* pool)
+{
+    struct __thrdpool_edf* edf = __atomic_load_n(&pool->edf,
+                                                 __ATOMIC_ACQUIRE);
+
+    return edf && __atomic_load_n(&edf->heap_cnt, __ATOMIC_RELAXED) > 0;
+}
+
+static void __thrdpool_edf_run(void* context)
+{
+    struct __thrdpool_edf_node* node = (struct __thrdpool_edf_node*)context;
+    struct thrdpool_task task = node->task;
+    thrdpool_t* pool = node->pool;
+    int late = node->late;
+
+    free(node);
+    if (!late)
+        task.routine(task.context);
+    else if (pool->late)
+        pool->late(&task, pool->late_context);
+}
+
+int thrdpool_schedule_deadline(const struct thrdpool_task* task,
+                               unsigned long long deadline,
+                               thrdpool_t* pool)
+{
+    struct __thrdpool_edf* edf = __thrdpool_get_edf(pool);
+    struct __thrdpool_edf_node* node;
+
+    if (!edf)
+        return -1;
+
+    node = (struct __thrdpool_edf_node*)malloc(
+        sizeof(struct __thrdpool_edf_node));
+    if (!node)
+        return -1;
+
+    node->entry.task.routine = __thrdpool_edf_run;
+    node->entry.task.context = node;
+    node->entry.flags = THRDPOOL_ENTRY_INPLACE;
+    node->entry.group = NULL;
+    if (pool->stats)
+        node->entry.stamp = __thrdpool_now();
+
+    node->task = *task;
+    node->pool = pool;
+    node->deadline = deadline;
+    node->child = NULL;
+    node->sibling = NULL;
+    node->late = 0;
+    pthread_mutex_lock(&edf->mutex);
+    edf->root = __thrdpool_edf_meld(edf->root, node);
+    __atomic_store_n(&edf->heap_cnt, edf->heap_cnt + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&edf->mutex);
+    __thrdpool_wake(1, pool);
+    return 0;
+}
+
+void thrdpool_set_deadline_policy(thrdpool_t* pool, int policy,
+                                  void (*late)(const struct thrdpool_task*,
+                                               void*),
+                                  void* context)
+{
+    pool->deadline_policy = policy;
+    pool->late = late;
+    pool->late_context = context;
+}
+
+// After the workers are gone; what never ran goes to pending.
+static void __thrdpool_destroy_edf(
+    void (*pending)(const struct thrdpool_task*), thrdpool_t* pool)
+{
+    struct __thrdpool_edf* edf = pool->edf;
+    struct __thrdpool_edf_node* node;
+
+    if (!edf)
+        return;
+
+    while ((node = __thrdpool_edf_pop(edf)) != NULL)
+    {
+        node->sibling = edf->late_head;
+        edf->late_head = node;
+    }
+
+    while ((node = edf->late_head) != NULL)
+    {
+        edf->late_head = node->sibling;
+        if (pending)
+            pending(&node->task);
+
+        free(node);
+    }
+
+    pthread_mutex_destroy(&edf->mutex);
+    free(edf);
+    pool->edf = NULL;
+}
+
+#define THRDPOOL_SERIAL_BATCH 32
+
+/* Tasks of a serial queue sit on a lock-free msgqueue of their own, and
+ * the serial queue takes its turn on the pool as a single drain task. A
+ * submission counts its task in pending once it is queued, and the one
+ * that takes pending from 0 schedules the drain; the drain runs up to a
+ * batch, then goes to the back of the lane if more is pending. Only the
+ * drain consumes the queue, so its get never waits on a lock. */
+struct __thrdpool_serial
+{
+    thrdpool_t* pool;
+    msgqueue_t* queue;
+    size_t pending; // submitted and not yet run
+    struct thrdpool_task_entry entry;
+};
+
+static void __thrdpool_serial_drain(void* context);
+
+static void __thrdpool_serial_put(struct __thrdpool_serial* serial)
+{
+    thrdpool_t* pool = serial->pool;
+
+    serial->entry.task.routine = __thrdpool_serial_drain;
+    serial->entry.task.context = serial;
+    serial->entry.flags = THRDPOOL_ENTRY_INPLACE;
+    serial->entry.group = NULL;
+    if (pool->stats)
+        serial->entry.stamp = __thrdpool_now();
+
+    __thrdpool_put(&serial->entry, 0, pool);
+}
+
+static void __thrdpool_serial_drain(void* context)
+{
+    struct __thrdpool_serial* serial = (struct __thrdpool_serial*)context;
+    struct thrdpool_task_entry* entries[THRDPOOL_SERIAL_BATCH];
+    struct thrdpool_task task;
+    size_t n = __atomic_load_n(&serial->pending, __ATOMIC_ACQUIRE);
+    size_t i;
+
+    /* Every task counted is queued already, so this gets all n; taking no
+     * more keeps pending from dropping below what is still queued. */
+    if (n > THRDPOOL_SERIAL_BATCH)
+        n = THRDPOOL_SERIAL_BATCH;
+
+    n = msgqueue_try_get_batch(serial->queue, (void**)entries, n);
+    for (i = 0; i < n; i++)
+    {
+        task = entries[i]->task;
+        __thrdpool_entry_free(entries[i]);
+        task.routine(task.context);
+    }
+
+    if (__atomic_sub_fetch(&serial->pending, n, __ATOMIC_ACQ_REL) > 0)
+        __thrdpool_serial_put(serial);
+}
+
+thrdpool_serial_t* thrdpool_serial_create(thrdpool_t* pool)
+{
+    thrdpool_serial_t* serial;
+
+    serial = (thrdpool_serial_t*)malloc(sizeof(thrdpool_serial_t));
+    if (!serial)
+        return NULL;
+
+    serial->queue = msgqueue_create_ex(0, 0, MSGQUEUE_LOCKFREE);
+    if (!serial->queue)
+    {
+        free(serial);
+        return NULL;
+    }
+
+    msgqueue_set_nonblock(serial->queue);
+    serial->pool = pool;
+    serial->pending = 0;
+    return serial;
+}
+
+int thrdpool_serial_schedule(const struct thrdpool_task* task,
+                             thrdpool_serial_t* serial)
+{
+    struct thrdpool_task_entry* entry = __thrdpool_entry_alloc();
+
+    if (!entry)
+        return -1;
+
+    entry->task = *task;
+    entry->flags = 0;
+    entry->group = NULL;
+    // Queue first: a drain only takes as many tasks as have been counted.
+    msgqueue_put(entry, serial->queue);
+    if (__atomic_fetch_add(&serial->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        __thrdpool_serial_put(serial);
+
+    return 0;
+}
+
+void thrdpool_serial_destory(thrdpool_serial_t* serial)
+{
+    msgqueue_destory(serial->queue);
+    free(serial);
+}
+
+// At destroy time: a queued drain hands every task behind it to pending.
+static void __thrdpool_serial_drop(struct __thrdpool_serial* serial,
+                                   void (*pending)(const struct thrdpool_task*))
+{
+    struct thrdpool_task_entry* entry;
+
+    while ((entry = (struct thrdpool_task_entry*)msgqueue_try_get(
+                serial->queue)) != NULL)
+    {
+        if (pending)
+            pending(&entry->task);
+
+        __thrdpool_entry_free(entry);
+    }
+
+    serial->pending = 0;
+}
+
+#define THRDPOOL_TICK 1000000 // timer resolution, ns
+
+#define THRDPOOL_TIMER_ARMED 0x1  // in the wheel
+#define THRDPOOL_TIMER_QUEUED 0x2 // entry handed to the pool, not started
+#define THRDPOOL_TIMER_HANDLE 0x4 // the caller holds a handle
+#define THRDPOOL_TIMER_CANCELED 0x8
+
+/* Created with the first timer. One thread advances the wheel and hands
+ * due timers to the pool; it sleeps until the tick the wheel next needs,
+ * and an earlier timer being added wakes it. */
+struct __thrdpool_timers
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    timerwheel_t* wheel;
+    unsigned long long base; // clock at tick 0
+    unsigned long long wake; // tick the thread sleeps until, 0 for ever
+    int stop;
+    pthread_t tid;
+};
+
+/* A timer frees itself once it is neither armed, queued nor held. A
+ * periodic timer that comes due while its last run is still queued skips
+ * that run rather than queueing another. */
+struct __thrdpool_timer
+{
+    struct timerwheel_node node;
+    struct thrdpool_task task;
+    struct thrdpool_task_entry entry;
+    struct __thrdpool_timers* timers;
+    thrdpool_t* pool;
+    unsigned long long period; // ticks, 0 for one-shot
+    struct __thrdpool_timer* fired;
+    int state;
+};
+
+static unsigned long long __thrdpool_tick(struct __thrdpool_timers* timers)
+{
+    return (__thrdpool_now() - timers->base) / THRDPOOL_TICK;
+}
+
+static void __thrdpool_timer_release(struct __thrdpool_timer* timer)
+{
+    if (!(timer->state & (THRDPOOL_TIMER_ARMED | THRDPOOL_TIMER_QUEUED |
+                          THRDPOOL_TIMER_HANDLE)))
+        free(timer);
+}
+
+static void __thrdpool_timer_routine(void* context)
+{
+    struct __thrdpool_timer* timer = (struct __thrdpool_timer*)context;
+    struct __thrdpool_timers* timers = timer->timers;
+    struct thrdpool_task task = timer->task;
+    int canceled;
+
+    pthread_mutex_lock(&timers->mutex);
+    timer->state &= ~THRDPOOL_TIMER_QUEUED;
+    canceled = timer->state & THRDPOOL_TIMER_CANCELED;
+    __thrdpool_timer_release(timer);
+    pthread_mutex_unlock(&timers->mutex);
+
+    if (!canceled)
+        task.routine(task.context);
+}
+
+static void* __thrdpool_timer_thread(void* arg)
+{
+    struct __thrdpool_timers* timers = (struct __thrdpool_timers*)arg;
+    struct __thrdpool_timer* fired;
+    struct __thrdpool_timer* timer;
+    struct timerwheel_node* node;
+    struct timerwheel_node* next;
+    struct thrdpool_task task;
+    unsigned long long now;
+    unsigned long long ns;
+    struct timespec abstime;
+
+    task.routine = __thrdpool_timer_routine;
+    pthread_mutex_lock(&timers->mutex);
+    while (!timers->stop)
+    {
+        now = __thrdpool_tick(timers);
+        fired = NULL;
+        for (node = timerwheel_advance(now, timers->wheel); node; node = next)
+        {
+            next = node->next;
+            timer = (struct __thrdpool_timer*)node;
+            timer->state &= ~THRDPOOL_TIMER_ARMED;
+            if (timer->period)
+            {
+                // Late ticks are dropped, not made up in a burst.
+                timerwheel_add(node, node->expire + timer->period > now ?
+                                     node->expire + timer->period : now + 1,
+                               timers->wheel);
+                timer->state |= THRDPOOL_TIMER_ARMED;
+            }
+
+            if (!(timer->state & THRDPOOL_TIMER_QUEUED))
+            {
+                timer->state |= THRDPOOL_TIMER_QUEUED;
+                timer->fired = fired;
+                fired = timer;
+            }
+        }
+
+        if (fired)
+        {
+            // Queued timers stay put until their routine runs.
+            pthread_mutex_unlock(&timers->mutex);
+            for (timer = fired; timer; timer = fired)
+            {
+                fired = timer->fired;
+                task.context = timer;
+                thrdpool_schedule_inplace(&task, &timer->entry, timer->pool);
+            }
+
+            pthread_mutex_lock(&timers->mutex);
+            continue;
+        }
+
+        timers->wake = timerwheel_next(timers->wheel);
+        if (timers->wake == 0)
+            pthread_cond_wait(&timers->cond, &timers->mutex);
+        else
+        {
+            ns = timers->base + timers->wake * THRDPOOL_TICK;
+            abstime.tv_sec = ns / 1000000000;
+            abstime.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&timers->cond, &timers->mutex, &abstime);
+        }
+    }
+
+    pthread_mutex_unlock(&timers->mutex);
+    return NULL;
+}
+
+static struct __thrdpool_timers* __thrdpool_create_timers(void)
+{
+    struct __thrdpool_timers* timers;
+    pthread_condattr_t attr;
+    int ret;
+
+    timers = (struct __thrdpool_timers*)malloc(
+        sizeof(struct __thrdpool_timers));
+    if (!timers)
+        return NULL;
+
+    timers->base = __thrdpool_now();
+    timers->wake = 0;
+    timers->stop = 0;
+    timers->wheel = timerwheel_create(0);
+    if (timers->wheel)
+    {
+        ret = pthread_mutex_init(&timers->mutex, NULL);
+        if (ret == 0)
+        {
+            ret = pthread_condattr_init(&attr);
+            if (ret == 0)
+            {
+                pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+                ret = pthread_cond_init(&timers->cond, &attr);
+                pthread_condattr_destroy(&attr);
+                if (ret == 0)
+                {
+                    ret = pthread_create(&timers->tid, NULL,
+                                         __thrdpool_timer_thread, timers);
+                    if (ret == 0)
+                        return timers;
+
+                    pthread_cond_destroy(&timers->cond);
+                }
+            }
+
+            pthread_mutex_destroy(&timers->mutex);
+        }
+
+        errno = ret;
+        timerwheel_destory(timers->wheel);
+    }
+
+    free(timers);
+    return NULL;
+}
+
+static struct __thrdpool_timers* __thrdpool_get_timers(thrdpool_t* pool)
+{
+    struct __thrdpool_timers* timers;
+
+    timers = __atomic_load_n(&pool->timers, __ATOMIC_ACQUIRE);
+    if (!timers)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        timers = pool->timers;
+        if (!timers)
+        {
+            timers = __thrdpool_create_timers();
+            __atomic_store_n(&pool->timers, timers, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return timers;
+}
+
+static int __thrdpool_add_timer(const struct thrdpool_task* task,
+                                long long ms, long long period,
+                                thrdpool_timer_t** handle, thrdpool_t* pool)
+{
+    struct __thrdpool_timers* timers = __thrdpool_get_timers(pool);
+    struct __thrdpool_timer* timer;
+    unsigned long long expire;
+
+    if (!timers)
+        return -1;
+
+    timer = (struct __thrdpool_timer*)malloc(sizeof(struct __thrdpool_timer));
+    if (!timer)
+        return -1;
+
+    if (ms < 0)
+        ms = 0;
+
+    timer->task = *task;
+    timer->timers = timers;
+    timer->pool = pool;
+    timer->period = period > 0 ? period : 0;
+    timer->state = THRDPOOL_TIMER_ARMED;
+    if (handle)
+    {
+        timer->state |= THRDPOOL_TIMER_HANDLE;
+        *handle = timer;
+    }
+
+    // Round up so that a timer never fires early.
+    expire = (__thrdpool_now() - timers->base + ms * 1000000 +
+              THRDPOOL_TICK - 1) / THRDPOOL_TICK;
+    pthread_mutex_lock(&timers->mutex);
+    timerwheel_add(&timer->node, expire, timers->wheel);
+    if (timers->wake == 0 || expire < timers->wake)
+    {
+        timers->wake = expire;
+        pthread_cond_signal(&timers->cond);
+    }
+
+    pthread_mutex_unlock(&timers->mutex);
+    return 0;
+}
+
+int thrdpool_schedule_after(const struct thrdpool_task* task, long long ms,
+                            thrdpool_timer_t** timer, thrdpool_t* pool)
+{
+    return __thrdpool_add_timer(task, ms, 0, timer, pool);
+}
+
+int thrdpool_schedule_every(const struct thrdpool_task* task, long long ms,
+                            thrdpool_timer_t** timer, thrdpool_t* pool)
+{
+    return __thrdpool_add_timer(task, ms, ms > 0 ? ms : 1, timer, pool);
+}
+
+int thrdpool_timer_cancel(thrdpool_timer_t* timer)
+{
+    struct __thrdpool_timers* timers = timer->timers;
+    int ret = 0;
+
+    pthread_mutex_lock(&timers->mutex);
+    if (timer->state & THRDPOOL_TIMER_ARMED)
+    {
+        timerwheel_remove(&timer->node, timers->wheel);
+        timer->state &= ~THRDPOOL_TIMER_ARMED;
+        ret = 1;
+    }
+
+    if ((timer->state & THRDPOOL_TIMER_QUEUED) &&
+        !(timer->state & THRDPOOL_TIMER_CANCELED))
+        ret = 1;
+
+    timer->state |= THRDPOOL_TIMER_CANCELED;
+    timer->state &= ~THRDPOOL_TIMER_HANDLE;
+    __thrdpool_timer_release(timer);
+    pthread_mutex_unlock(&timers->mutex);
+    return ret;
+}
+
+#define THRDPOOL_CORO_STACK (64 * 1024)
+
+// Coroutine state, for the suspend/resume handshake.
+#define THRDPOOL_CORO_RUNNING 0
+#define THRDPOOL_CORO_SUSPENDING 1 // switching out, not yet off its stack
+#define THRDPOOL_CORO_PARKED 2
+#define THRDPOOL_CORO_RESUMED 3 // resumed before it got to park
+
+// What a coroutine leaves for the worker when it switches out.
+#define THRDPOOL_CORO_DONE 1
+#define THRDPOOL_CORO_YIELD 2
+#define THRDPOOL_CORO_SUSPEND 3
+
+/* Created with the first coroutine. Coroutines and their stacks are never
+ * unmapped while the pool lives; a finished one goes on the free list. */
+struct __thrdpool_coros
+{
+    pthread_mutex_t mutex;
+    struct __thrdpool_coro* free;
+    struct __thrdpool_coro* all;
+    size_t stacksize;
+};
+
+/* A coroutine runs as a chain of pool tasks, one per stretch between
+ * switches, each on an entry embedded here; it may resume on a different
+ * worker from the one it left. */
+struct __thrdpool_coro
+{
+    ucontext_t ctx;
+    ucontext_t* caller;
+    struct thrdpool_task task;
+    struct thrdpool_task_entry entry;
+    thrdpool_t* pool;
+    char* stack; // guard page first
+    size_t size;
+    struct __thrdpool_coro* next_free;
+    struct __thrdpool_coro* next_all;
+    struct __thrdpool_coro* outer; // nesting on this thread, while running
+    int state;
+    int op;
+    int started;
+    int orphaned; // its pool was destroyed from it
+};
+
+static __thread struct __thrdpool_coro* __coro;
+
+static void __thrdpool_coro_run(void* context);
+
+static struct __thrdpool_coros* __thrdpool_get_coros(thrdpool_t* pool)
+{
+    struct __thrdpool_coros* coros;
+
+    coros = __atomic_load_n(&pool->coros, __ATOMIC_ACQUIRE);
+    if (!coros)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        coros = pool->coros;
+        if (!coros)
+        {
+            coros = (struct __thrdpool_coros*)malloc(
+                sizeof(struct __thrdpool_coros));
+            if (coros && pthread_mutex_init(&coros->mutex, NULL) == 0)
+            {
+                coros->free = NULL;
+                coros->all = NULL;
+                coros->stacksize = pool->coroutine_stacksize ?
+                                   pool->coroutine_stacksize :
+                                   THRDPOOL_CORO_STACK;
+                __atomic_store_n(&pool->coros, coros, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                free(coros);
+                coros = NULL;
+            }
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return coros;
+}
+
+static struct __thrdpool_coro* __thrdpool_coro_alloc(thrdpool_t* pool)
+{
+    struct __thrdpool_coros* coros = __thrdpool_get_coros(pool);
+    struct __thrdpool_coro* coro;
+
+    if (!coros)
+        return NULL;
+
+    pthread_mutex_lock(&coros->mutex);
+    coro = coros->free;
+    if (coro)
+        coros->free = coro->next_free;
+
+    pthread_mutex_unlock(&coros->mutex);
+    if (coro)
+        return coro;
+
+    coro = (struct __thrdpool_coro*)malloc(sizeof(struct __thrdpool_coro));
+    if (!coro)
+        return NULL;
+
+    coro->size = __thrdpool_stack_bytes(coros->stacksize);
+    coro->stack = __thrdpool_stack_get(coro->size);
+    if (!coro->stack)
+    {
+        free(coro);
+        return NULL;
+    }
+
+    coro->pool = pool;
+    coro->started = 0;
+    coro->orphaned = 0;
+    coro->state = THRDPOOL_CORO_RUNNING;
+    pthread_mutex_lock(&coros->mutex);
+    coro->next_all = coros->all;
+    coros->all = coro;
+    pthread_mutex_unlock(&coros->mutex);
+    return coro;
+}
+
+static void __thrdpool_coro_free(struct __thrdpool_coro* coro)
+{
+    struct __thrdpool_coros* coros = coro->pool->coros;
+
+    coro->started = 0;
+    coro->state = THRDPOOL_CORO_RUNNING;
+    pthread_mutex_lock(&coros->mutex);
+    coro->next_free = coros->free;
+    coros->free = coro;
+    pthread_mutex_unlock(&coros->mutex);
+}
+
+// Requeued at the back of the shared lane, not the LIFO worker deque.
+static void __thrdpool_coro_put(struct __thrdpool_coro* coro)
+{
+    thrdpool_t* pool = coro->pool;
+
+    coro->entry.task.routine = __thrdpool_coro_run;
+    coro->entry.task.context = coro;
+    coro->entry.flags = THRDPOOL_ENTRY_INPLACE;
+    coro->entry.group = NULL;
+    if (pool->stats)
+        coro->entry.stamp = __thrdpool_now();
+
+    __thrdpool_put(&coro->entry, 0, pool);
+}
+
+static void __thrdpool_coro_switch(struct __thrdpool_coro* coro, int op)
+{
+    coro->op = op;
+    swapcontext(&coro->ctx, coro->caller);
+}
+
+static void __thrdpool_coro_main(void)
+{
+    struct __thrdpool_coro* coro = __coro;
+
+    coro->task.routine(coro->task.context);
+    __thrdpool_coro_switch(coro, THRDPOOL_CORO_DONE);
+}
+
+static void __thrdpool_coro_run(void* context)
+{
+    struct __thrdpool_coro* coro = (struct __thrdpool_coro*)context;
+    struct __thrdpool_coro* prev = __coro;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    ucontext_t caller;
+    int state;
+
+    if (!coro->started)
+    {
+        getcontext(&coro->ctx);
+        coro->ctx.uc_stack.ss_sp = coro->stack + page;
+        coro->ctx.uc_stack.ss_size = coro->size - page;
+        coro->ctx.uc_link = NULL;
+        makecontext(&coro->ctx, __thrdpool_coro_main, 0);
+        coro->started = 1;
+    }
+
+    // Run from a task that is itself a coroutine, this nests.
+    coro->caller = &caller;
+    coro->outer = prev;
+    __coro = coro;
+    swapcontext(&caller, &coro->ctx);
+    __coro = prev;
+
+    // Left by __thrdpool_destroy_coros() to free now that it is off its stack.
+    if (coro->orphaned)
+    {
+        __thrdpool_stack_put(coro->stack, coro->size);
+        free(coro);
+        return;
+    }
+
+    switch (coro->op)
+    {
+    case THRDPOOL_CORO_DONE:
+        __thrdpool_coro_free(coro);
+        break;
+    case THRDPOOL_CORO_YIELD:
+        __thrdpool_coro_put(coro);
+        break;
+    case THRDPOOL_CORO_SUSPEND:
+        // Off its stack now, so a resume may schedule it.
+        state = THRDPOOL_CORO_SUSPENDING;
+        if (!__atomic_compare_exchange_n(&coro->state, &state,
+                                         THRDPOOL_CORO_PARKED, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&coro->state, THRDPOOL_CORO_RUNNING,
+                             __ATOMIC_RELAXED);
+            __thrdpool_coro_put(coro);
+        }
+
+        break;
+    }
+}
+
+int thrdpool_schedule_coroutine(const struct thrdpool_task* task,
+                                thrdpool_t* pool)
+{
+    struct __thrdpool_coro* coro = __thrdpool_coro_alloc(pool);
+    struct thrdpool_task run = {
+        .routine = __thrdpool_coro_run,
+        .context = coro,
+    };
+
+    if (!coro)
+        return -1;
+
+    coro->task = *task;
+    thrdpool_schedule_inplace(&run, &coro->entry, pool);
+    return 0;
+}
+
+thrdpool_coroutine_t* thrdpool_coroutine_self(void)
+{
+    return (thrdpool_coroutine_t*)__coro;
+}
+
+int thrdpool_yield(void)
+{
+    if (!__coro)
+    {
+        errno = EPERM;
+        return -1;
+    }
+
+    __thrdpool_coro_switch(__coro, THRDPOOL_CORO_YIELD);
+    return 0;
+}
+
+int thrdpool_suspend(void)
+{
+    struct __thrdpool_coro* coro = __coro;
+    int state = THRDPOOL_CORO_RUNNING;
+
+    if (!coro)
+    {
+        errno = EPERM;
+        return -1;
+    }
+
+    // A resume that came first is used up instead of switching out.
+    if (__atomic_compare_exchange_n(&coro->state, &state,
+                                    THRDPOOL_CORO_SUSPENDING, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        __thrdpool_coro_switch(coro, THRDPOOL_CORO_SUSPEND);
+    else
+        __atomic_store_n(&coro->state, THRDPOOL_CORO_RUNNING,
+                         __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void thrdpool_resume(thrdpool_coroutine_t* coroutine)
+{
+    struct __thrdpool_coro* coro = (struct __thrdpool_coro*)coroutine;
+    int state = __atomic_load_n(&coro->state, __ATOMIC_ACQUIRE);
+
+    while (state != THRDPOOL_CORO_RESUMED)
+    {
+        if (state == THRDPOOL_CORO_PARKED)
+        {
+            if (__atomic_compare_exchange_n(&coro->state, &state,
+                                            THRDPOOL_CORO_RUNNING, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+            {
+                __thrdpool_coro_put(coro);
+                return;
+            }
+        }
+        else if (__atomic_compare_exchange_n(&coro->state, &state,
+                                             THRDPOOL_CORO_RESUMED, 0,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+            return;
+    }
+}
+
+/* After the workers are gone; coroutines still parked are dropped. When
+ * the pool is destroyed from a coroutine, that one and any it is nested
+ * in are still running on their stacks: each is only marked, and frees
+ * itself once it switches back out in __thrdpool_coro_run(). */
+static void __thrdpool_destroy_coros(thrdpool_t* pool)
+{
+    struct __thrdpool_coros* coros = pool->coros;
+    struct __thrdpool_coro* coro;
+    struct __thrdpool_coro* next;
+
+    if (!coros)
+        return;
+
+    for (coro = __coro; coro; coro = coro->outer)
+    {
+        if (coro->pool == pool)
+            coro->orphaned = 1;
+    }
+
+    for (coro = coros->all; coro; coro = next)
+    {
+        next = coro->next_all;
+        if (!coro->orphaned)
+        {
+            __thrdpool_stack_put(coro->stack, coro->size);
+            free(coro);
+        }
+    }
+
+    pthread_mutex_destroy(&coros->mutex);
+    free(coros);
+    pool->coros = NULL;
+}
+
+/* Drain leftovers at destroy time. Canceled tasks skip pending, and a
+ * timer's queued entry goes to it as the timer's own task. */
+static void __thrdpool_drop_entry(struct thrdpool_task_entry* entry,
+                                  void (*pending)(const struct thrdpool_task*))
+{
+    struct thrdpool_task task = entry->task;
+    struct __thrdpool_timer* timer;
+    struct __thrdpool_coro* coro;
+
+    if (entry->flags & THRDPOOL_ENTRY_HANDLE)
+    {
+        if (__thrdpool_entry_claim(entry) && pending)
+            pending(&task);
+
+        return;
+    }
+
+    if (entry->task.routine == __thrdpool_serial_drain)
+    {
+        __thrdpool_serial_drop((struct __thrdpool_serial*)entry->task.context,
+                               pending);
+        return;
+    }
+
+    if (entry->task.routine == __thrdpool_coro_run)
+    {
+        // Freed with the rest; only one that never started is pending.
+        coro = (struct __thrdpool_coro*)entry->task.context;
+        if (pending && !coro->started)
+            pending(&coro->task);
+
+        return;
+    }
+
+    if (entry->task.routine != __thrdpool_timer_routine)
+    {
+        if (pending)
+            pending(&entry->task);
+
+        __thrdpool_entry_free(entry);
+        return;
+    }
+
+    timer = (struct __thrdpool_timer*)entry->task.context;
+    if (pending && !(timer->state & THRDPOOL_TIMER_CANCELED))
+        pending(&timer->task);
+
+    timer->state &= ~THRDPOOL_TIMER_QUEUED;
+    __thrdpool_timer_release(timer);
+}
+
+// Before the workers go, so that nothing new is scheduled.
+static void __thrdpool_stop_timers(thrdpool_t* pool)
+{
+    struct __thrdpool_timers* timers = pool->timers;
+
+    if (!timers)
+        return;
+
+    pthread_mutex_lock(&timers->mutex);
+    timers->stop = 1;
+    pthread_cond_signal(&timers->cond);
+    pthread_mutex_unlock(&timers->mutex);
+    pthread_join(timers->tid, NULL);
+}
+
+// After the queues are drained; frees timers still in the wheel.
+static void __thrdpool_destroy_timers(thrdpool_t* pool)
+{
+    struct __thrdpool_timers* timers = pool->timers;
+    struct timerwheel_node* node;
+    struct timerwheel_node* next;
+
+    if (!timers)
+        return;
+
+    for (node = timerwheel_drain(timers->wheel); node; node = next)
+    {
+        next = node->next;
+        free(node);
+    }
+
+    timerwheel_destory(timers->wheel);
+    pthread_cond_destroy(&timers->cond);
+    pthread_mutex_destroy(&timers->mutex);
+    free(timers);
+    pool->timers = NULL;
+}
+
+int thrdpool_in_pool(thrdpool_t* pool)
+{
+    return pthread_getspecific(pool->key) != NULL;
+}
+
+void thrdpool_get_stats(struct thrdpool_stats* stats, thrdpool_t* pool)
+{
+    struct __thrdpool_worker* worker = pool->workers;
+    const struct __thrdpool_stats* slot;
+    size_t max;
+    int i;
+
+    memset(stats, 0, sizeof(struct thrdpool_stats));
+    stats->nthreads = pool->nthreads;
+    for (i = 0; i < pool->nqueues; i++)
+    {
+        stats->queued += msgqueue_size(pool->lanes[i].queue);
+        max = msgqueue_high_watermark(pool->lanes[i].queue);
+        if (max > stats->queued_max)
+            stats->queued_max = max;
+    }
+
+    // Slots are never freed while the pool lives; walk the ring like a thief.
+    while (worker)
+    {
+        slot = &worker->stats;
+        stats->tasks += __atomic_load_n(&slot->tasks, __ATOMIC_RELAXED);
+        stats->steals += __atomic_load_n(&slot->steals, __ATOMIC_RELAXED);
+        stats->parks += __atomic_load_n(&slot->parks, __ATOMIC_RELAXED);
+        stats->sleeps += __atomic_load_n(&slot->sleeps, __ATOMIC_RELAXED);
+        for (i = 0; i < THRDPOOL_HIST_BUCKETS; i++)
+        {
+            stats->wait_hist[i] +=
+                __atomic_load_n(&slot->wait_hist[i], __ATOMIC_RELAXED);
+            stats->run_hist[i] +=
+                __atomic_load_n(&slot->run_hist[i], __ATOMIC_RELAXED);
+        }
+
+        worker = __atomic_load_n(&worker->next, __ATOMIC_ACQUIRE);
+        if (worker == pool->workers)
+            break;
+    }
+}
+
+unsigned long long thrdpool_hist_percentile(
+    const unsigned long long hist[THRDPOOL_HIST_BUCKETS], double q)
+{
+    unsigned long long total = 0;
+    unsigned long long sum = 0;
+    int i;
+
+    for (i = 0; i < THRDPOOL_HIST_BUCKETS; i++)
+        total += hist[i];
+
+    for (i = 0; i < THRDPOOL_HIST_BUCKETS; i++)
+    {
+        sum += hist[i];
+        if (sum > 0 && sum >= q * total)
+            break;
+    }
+
+    if (i == THRDPOOL_HIST_BUCKETS)
+        return 0;
+
+    if (i < 4)
+        return i;
+
+    return (unsigned long long)(4 + i % 4) << (i / 4 - 1);
+}
+
+/* Ahead of stopping the timers, so that drain mode runs what was staged.
+ * No list can be added now, and pool->mutex is not taken: a flush may
+ * need it to start a lazy pool's first worker. */
+static void __thrdpool_flush_stages(thrdpool_t* pool)
+{
+    struct __thrdpool_stage* stage;
+
+    for (stage = __atomic_load_n(&pool->stages, __ATOMIC_ACQUIRE); stage;
+         stage = stage->next)
+    {
+        pthread_mutex_lock(&stage->mutex);
+        if (stage->timer)
+        {
+            thrdpool_timer_cancel(stage->timer);
+            stage->timer = NULL;
+        }
+
+        __thrdpool_stage_flush(stage);
+        pthread_mutex_unlock(&stage->mutex);
+    }
+}
+
+static void __thrdpool_destroy_stages(thrdpool_t* pool)
+{
+    struct __thrdpool_stage* stage;
+
+    while (pool->stages)
+    {
+        stage = pool->stages;
+        pool->stages = stage->next;
+        pthread_mutex_destroy(&stage->mutex);
+        free(stage);
+    }
+
+    if (pool->stage_ready)
+        pthread_key_delete(pool->stage_key);
+}
+
+// Once every worker has exited: drain what is left and free the pool.
+static void __thrdpool_teardown(void (*pending)(const struct thrdpool_task*),
+                                int in_pool, thrdpool_t* pool)
+{
+    struct thrdpool_task_entry* entry;
+    int i;
+
+    for (i = 0; i < pool->nqueues; i++)
+    {
+        while (1)
+        {
+            entry = (struct thrdpool_task_entry*)msgqueue_get(
+                pool->lanes[i].queue);
+            if (!entry)
+                break;
+            __thrdpool_drop_entry(entry, pending);
+        }
+    }
+
+    __thrdpool_free_workers(pending, pool);
+    __thrdpool_destroy_timers(pool);
+    __thrdpool_destroy_coros(pool);
+    __thrdpool_destroy_edf(pending, pool);
+    __thrdpool_destroy_stages(pool);
+    pthread_key_delete(pool->key);
+    pthread_cond_destroy(&pool->park_cond);
+    pthread_mutex_destroy(&pool->park_mutex);
+    pthread_mutex_destroy(&pool->mutex);
+    __thrdpool_destroy_lanes(pool);
+    __thrdpool_destroy_placement(pool);
+    if (!in_pool)
+    {
+        free(pool);
+    }
+}
+
+int thrdpool_shutdown(void (*pending)(const struct thrdpool_task*),
+                      int mode, long long ms, thrdpool_t* pool)
+{
+    int in_pool = thrdpool_in_pool(pool);
+    int ret;
+
+    __thrdpool_flush_stages(pool);
+    __thrdpool_stop_timers(pool);
+    ret = __thrdpool_terminate(in_pool, mode == THRDPOOL_SHUTDOWN_DRAIN, ms,
+                               pool);
+    __thrdpool_teardown(pending, in_pool, pool);
+    return ret;
+}
+
+void thrdpool_destory(
+    void (*pending)(const struct thrdpool_task*), thrdpool_t* pool)
+{
+    thrdpool_shutdown(pending, THRDPOOL_SHUTDOWN_ABANDON, 0, pool);
+}
+
+struct __thrdpool_shards
+{
+    size_t nshards;
+    thrdpool_t* pools[];
+};
+
+// The shard's slice of params->cpus, or one cpu if there are fewer cpus.
+static void __thrdpool_shard_params(size_t index, size_t nshards,
+                                    const struct thrdpool_params* params,
+                                    struct thrdpool_params* shard)
+{
+    size_t first = index * params->ncpus / nshards;
+    size_t last = (index + 1) * params->ncpus / nshards;
+
+    *shard = *params;
+    if (!params->cpus || params->ncpus == 0)
+        return;
+
+    if (first == last)
+    {
+        first = index % params->ncpus;
+        last = first + 1;
+    }
+
+    shard->cpus = params->cpus + first;
+    shard->ncpus = last - first;
+    if (params->cpu_nodes)
+        shard->cpu_nodes = params->cpu_nodes + first;
+}
+
+thrdpool_shards_t* thrdpool_shards_create(size_t nshards,
+                                          const struct thrdpool_params* params)
+{
+    struct thrdpool_params shard;
+    thrdpool_shards_t* shards;
+    thrdpool_t* pool;
+    size_t i;
+
+    if (nshards == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    shards = (thrdpool_shards_t*)malloc(sizeof(thrdpool_shards_t) +
+                                        nshards * sizeof(thrdpool_t*));
+    if (!shards)
+        return NULL;
+
+    for (i = 0; i < nshards; i++)
+    {
+        __thrdpool_shard_params(i, nshards, params, &shard);
+        shards->pools[i] = __thrdpool_create(&shard, 1);
+        if (!shards->pools[i])
+            break;
+    }
+
+    if (i < nshards)
+    {
+        while (i > 0)
+            thrdpool_destory(NULL, shards->pools[--i]);
+
+        free(shards);
+        return NULL;
+    }
+
+    // Link the ring only now; no task has been scheduled yet.
+    shards->nshards = nshards;
+    for (i = 0; i < nshards && nshards > 1; i++)
+    {
+        pool = shards->pools[i];
+        __atomic_store_n(&pool->peers[0], shards->pools[(i + 1) % nshards],
+                         __ATOMIC_RELEASE);
+        if (nshards > 2)
+        {
+            __atomic_store_n(&pool->peers[1],
+                             shards->pools[(i + nshards - 1) % nshards],
+                             __ATOMIC_RELEASE);
+        }
+    }
+
+    return shards;
+}
+
+/* Jump consistent hash (Lamping and Veach) over a mixed key: no table, and
+ * growing the shard count moves only the keys the new shard takes. */
+thrdpool_t* thrdpool_shard_of(unsigned long long key,
+                              thrdpool_shards_t* shards)
+{
+    long long b = 0;
+    long long j = 0;
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    while (j < (long long)shards->nshards)
+    {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (long long)((b + 1) * ((double)(1LL << 31) /
+                                   (double)((key >> 33) + 1)));
+    }
+
+    return shards->pools[b];
+}
+
+int thrdpool_schedule_keyed(unsigned long long key,
+                            const struct thrdpool_task* task,
+                            thrdpool_shards_t* shards)
+{
+    return thrdpool_schedule(task, thrdpool_shard_of(key, shards));
+}
+
+size_t thrdpool_shards_count(thrdpool_shards_t* shards)
+{
+    return shards->nshards;
+}
+
+thrdpool_t* thrdpool_shards_get(size_t index, thrdpool_shards_t* shards)
+{
+    return shards->pools[index];
+}
+
+// Every shard stops before any is freed, since peers pull from each other.
+void thrdpool_shards_destory(void (*pending)(const struct thrdpool_task*),
+                             thrdpool_shards_t* shards)
+{
+    size_t i;
+
+    for (i = 0; i < shards->nshards; i++)
+    {
+        __thrdpool_flush_stages(shards->pools[i]);
+        __thrdpool_stop_timers(shards->pools[i]);
+        __thrdpool_terminate(0, 0, -1, shards->pools[i]);
+    }
+
+    for (i = 0; i < shards->nshards; i++)
+        __thrdpool_teardown(pending, 0, shards->pools[i]);
+
+    free(shards);
+}
@@ -4,23 +4,312 @@
 #include <stddef.h>
 
 typedef struct __thrdpool thrdpool_t;
+typedef struct __thrdpool_group thrdpool_group_t;
+typedef struct __thrdpool_timer thrdpool_timer_t;
+typedef struct __thrdpool_handle thrdpool_handle_t;
+typedef struct __thrdpool_coro thrdpool_coroutine_t;
+typedef struct __thrdpool_serial thrdpool_serial_t;
+typedef struct __thrdpool_shards thrdpool_shards_t;
+
+#define THRDPOOL_PRIO_MAX 8
+#define THRDPOOL_NODE_MAX 16
+#define THRDPOOL_HIST_BUCKETS 160
+
+/* thrdpool_shutdown() modes */
+#define THRDPOOL_SHUTDOWN_ABANDON 0
+#define THRDPOOL_SHUTDOWN_DRAIN 1
+
+/* thrdpool_set_deadline_policy() policies, for deadline tasks found past
+ * their deadline when a worker takes them: run them anyway, hand them to
+ * the late callback instead of running them, or move them behind every
+ * other queued task. */
+#define THRDPOOL_DEADLINE_RUN 0
+#define THRDPOOL_DEADLINE_DROP 1
+#define THRDPOOL_DEADLINE_DEMOTE 2
 
 struct thrdpool_task {
     void (*routine)(void *);
     void *context;
 };
 
+/* Queue node of a scheduled task. thrdpool_schedule() allocates one from a
+ * per-thread cache; thrdpool_schedule_inplace() lets the caller embed it in
+ * its own object instead. An embedded entry must stay valid until its
+ * routine starts, and may be reused from inside the routine. */
+struct thrdpool_task_entry {
+    void *link;
+    struct thrdpool_task task;
+    int flags;
+    thrdpool_group_t *group;
+    unsigned long long stamp; /* enqueue time, with params.stats */
+};
+
+/* Pool totals from thrdpool_get_stats(), summed over every worker slot the
+ * pool has had. Histograms are in nanoseconds, log-linear with 4 buckets
+ * per power of two; see thrdpool_hist_percentile(). */
+struct thrdpool_stats {
+    size_t nthreads;
+    size_t queued;        /* tasks waiting in the shared lanes */
+    size_t queued_max;    /* deepest any lane has been */
+    unsigned long long tasks;   /* run, canceled ones not included */
+    unsigned long long steals;
+    unsigned long long parks;   /* times a worker went idle */
+    unsigned long long sleeps;  /* times an idle worker blocked */
+    unsigned long long wait_hist[THRDPOOL_HIST_BUCKETS];
+    unsigned long long run_hist[THRDPOOL_HIST_BUCKETS];
+};
+
+struct thrdpool_params {
+    size_t nthreads;
+    /* With stacksize set, worker stacks get a guard page and come from a
+     * cache that every pool in the process shares, as do coroutine stacks;
+     * cached stacks keep their address space but no memory. */
+    size_t stacksize;
+    int msgqueue_flags; /* passed to msgqueue_create_ex() */
+    /* Per-worker work-stealing deque capacity. With a nonzero size, tasks
+     * scheduled from inside the pool stay on the calling worker's deque
+     * (LIFO) while no worker is idle, and idle workers steal from peers
+     * before falling back to the shared queue. 0 disables. */
+    size_t deque_size;
+    /* Idle worker spin iterations before parking. Adapts like
+     * msgqueue_set_spin(). */
+    int spin;
+    /* Number of priority lanes, 1..THRDPOOL_PRIO_MAX. Lane 0 is the most
+     * urgent and is where thrdpool_schedule() puts tasks. */
+    int prio_levels;
+    /* Every starvation_limit-th dequeue of a worker serves the lowest
+     * non-empty lane first. 0 disables the guard. */
+    int starvation_limit;
+    /* Pin worker i to cpus[i % ncpus]. NULL leaves placement to the OS. */
+    const int *cpus;
+    size_t ncpus;
+    /* NUMA node of each cpu in cpus, numbered from 0, or NULL for a single
+     * node. Every node gets its own set of lanes: tasks go to the node they
+     * are scheduled from, and workers serve and steal from their own node
+     * before the others. */
+    const int *cpu_nodes;
+    /* Elastic sizing. While every worker is busy and grow_backlog or more
+     * tasks are queued, scheduling adds a worker, up to max_threads. With
+     * idle_timeout (ms) set, a worker that stays idle that long retires,
+     * down to min_threads (at least 1). 0 disables either side. */
+    size_t max_threads;
+    size_t min_threads;
+    size_t grow_backlog;
+    int idle_timeout;
+    /* Fill the wait (enqueue to start) and run time histograms. Costs two
+     * clock reads per task and one per schedule call. */
+    int stats;
+    /* Most tasks a lane may hold. Past it, thrdpool_schedule() and friends
+     * fail with EAGAIN so callers can shed load; thrdpool_schedule_inplace()
+     * is not limited. 0 is unbounded. */
+    size_t queue_max;
+    /* Stack size of tasks run by thrdpool_schedule_coroutine(); 0 for
+     * 64 KiB. Stacks get a guard page and are reused. */
+    size_t coroutine_stacksize;
+    /* Staging. With stage_max set, thrdpool_schedule() from outside the
+     * pool (or from a worker without a deque) collects tasks on a list of
+     * the calling thread's own, and hands the list to the queue in one go
+     * once it holds stage_max tasks, stage_timeout ms (at least 1) after
+     * its first task, at thread exit or on thrdpool_flush(). Staged tasks
+     * do not count against queue_max. 0 disables. */
+    size_t stage_max;
+    int stage_timeout;
+    /* Lazy start. The pool starts with min_threads workers, none by
+     * default, and adds one whenever a task is queued while every worker
+     * is busy, up to nthreads (or max_threads if larger); idle_timeout
+     * still retires them, though never the last one. stacksize 0 means
+     * 256 KiB here instead of the pthread default. */
+    int lazy;
+    /* Continuations. thrdpool_schedule() from a worker of this pool, while
+     * nothing else is queued (the worker's own deque included), runs the
+     * task at once on the calling worker, nested at most inline_depth deep;
+     * one more is kept to run right after the current task, and the rest
+     * queue as usual, so the caller's order holds. The task thus may run
+     * before thrdpool_schedule() returns: do not hold locks it takes, and
+     * do not destroy the pool from it. Coroutines never run tasks inline,
+     * as they may switch out meanwhile. 0 disables. */
+    int inline_depth;
+};
+
+#define THRDPOOL_PARAMS_DEFAULT \
+{ \
+    .nthreads = 4, \
+    .stacksize = 0, \
+    .msgqueue_flags = 0, \
+    .deque_size = 0, \
+    .spin = 0, \
+    .prio_levels = 1, \
+    .starvation_limit = 32, \
+    .cpus = NULL, \
+    .ncpus = 0, \
+    .cpu_nodes = NULL, \
+    .max_threads = 0, \
+    .min_threads = 0, \
+    .grow_backlog = 0, \
+    .idle_timeout = 0, \
+    .stats = 0, \
+    .queue_max = 0, \
+    .coroutine_stacksize = 0, \
+    .stage_max = 0, \
+    .stage_timeout = 0, \
+    .lazy = 0, \
+    .inline_depth = 0, \
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 thrdpool_t *thrdpool_create(size_t nthreads, size_t stacksize);
+thrdpool_t *thrdpool_create_ex(const struct thrdpool_params *params);
 int thrdpool_schedule(const struct thrdpool_task *task, thrdpool_t *pool);
+/* prio 0 is the same as thrdpool_schedule(); larger values are less urgent
+ * and are clamped to the pool's last lane. */
+int thrdpool_schedule_prio(
+    const struct thrdpool_task *task, int prio, thrdpool_t *pool);
+void thrdpool_schedule_inplace(const struct thrdpool_task *task,
+                               struct thrdpool_task_entry *entry,
+                               thrdpool_t *pool);
+/* Like thrdpool_schedule(), and hands back a handle for thrdpool_cancel().
+ * A canceled task still takes its place in the queue, but the worker that
+ * dequeues it skips it. Every handle must be released exactly once. */
+int thrdpool_schedule_cancelable(const struct thrdpool_task *task,
+                                 thrdpool_handle_t **handle,
+                                 thrdpool_t *pool);
+/* Returns 1 if the task had not started and now never will, else 0. */
+int thrdpool_cancel(thrdpool_handle_t *handle);
+void thrdpool_handle_release(thrdpool_handle_t *handle);
+/* Schedule n tasks with a single queue operation. All or nothing. */
+int thrdpool_schedule_batch(
+    const struct thrdpool_task *tasks, size_t n, thrdpool_t *pool);
+/* Queue whatever the calling thread has staged; see stage_max. */
+void thrdpool_flush(thrdpool_t *pool);
+/* deadline is in CLOCK_MONOTONIC nanoseconds. Workers serve deadline tasks
+ * earliest deadline first and ahead of every lane. */
+int thrdpool_schedule_deadline(const struct thrdpool_task *task,
+                               unsigned long long deadline,
+                               thrdpool_t *pool);
+/* late(task, context) runs on the worker in place of a dropped task; it
+ * may be NULL. Not to be changed while deadline tasks are queued. */
+void thrdpool_set_deadline_policy(thrdpool_t *pool, int policy,
+                                  void (*late)(const struct thrdpool_task *,
+                                               void *),
+                                  void *context);
+/* Run the task as a coroutine on a small stack of its own, so that it can
+ * give up its worker with thrdpool_yield() or thrdpool_suspend() and
+ * carry on later, possibly on another worker. Parked coroutines cost a
+ * stack, not a thread; ones still parked at thrdpool_destory() are
+ * dropped. Like any task, a coroutine may destroy its own pool. */
+int thrdpool_schedule_coroutine(const struct thrdpool_task *task,
+                                thrdpool_t *pool);
+/* The coroutine running on this thread, or NULL outside one. */
+thrdpool_coroutine_t *thrdpool_coroutine_self(void);
+/* From a coroutine: requeue behind the tasks already waiting. Fails with
+ * EPERM anywhere else, as does thrdpool_suspend(). */
+int thrdpool_yield(void);
+/* From a coroutine: switch out until thrdpool_resume() is called on it.
+ * A resume that comes first makes the next suspend return at once. */
+int thrdpool_suspend(void);
+void thrdpool_resume(thrdpool_coroutine_t *coroutine);
 int thrdpool_increase(thrdpool_t *pool);
+/* Retire one worker once it finishes the task it is running. */
+int thrdpool_decrease(thrdpool_t *pool);
+/* Task groups. thrdpool_group_wait() returns once every task scheduled
+ * through the group has finished, and leaves the group ready for another
+ * round; called from a worker, it runs queued tasks meanwhile rather than
+ * blocking the worker. thrdpool_group_close() is the asynchronous form:
+ * done, if not NULL, is scheduled once the tasks have finished after a
+ * wait or close, and may destroy a closed group. Tasks are scheduled by
+ * the thread that waits or closes, or by the group's own tasks. */
+thrdpool_group_t *thrdpool_group_create(const struct thrdpool_task *done,
+                                        thrdpool_t *pool);
+int thrdpool_group_schedule(const struct thrdpool_task *task,
+                            thrdpool_group_t *group);
+void thrdpool_group_wait(thrdpool_group_t *group);
+void thrdpool_group_close(thrdpool_group_t *group);
+void thrdpool_group_destory(thrdpool_group_t *group);
+/* Serial queues. Tasks of one serial queue run one at a time and in
+ * submission order, each seeing the effects of the one before; different
+ * serial queues, and plain tasks, run in parallel. A serial queue drains
+ * a batch of its tasks per turn on a worker. Destroy it only once its
+ * tasks have run, or after thrdpool_destory(), which hands its queued
+ * tasks to pending. */
+thrdpool_serial_t *thrdpool_serial_create(thrdpool_t *pool);
+int thrdpool_serial_schedule(const struct thrdpool_task *task,
+                             thrdpool_serial_t *serial);
+void thrdpool_serial_destory(thrdpool_serial_t *serial);
+/* Run fn over [begin, end) in chunks of grain indices, splitting the range
+ * recursively across the pool, and return when all chunks are done. The
+ * caller works on it too. grain 0 sizes chunks from a timed probe, to a
+ * few per worker at most. Returns -1 if out of memory, before any chunk
+ * but the probe has run. */
+int thrdpool_parallel_for(thrdpool_t *pool, size_t begin, size_t end,
+                          size_t grain,
+                          void (*fn)(size_t begin, size_t end, void *context),
+                          void *context);
+/* Like thrdpool_parallel_for(), but each chunk folds into its own size
+ * byte accumulator, set up by init; join then folds the accumulators into
+ * result in index order. result is initialised with init too. */
+int thrdpool_parallel_reduce(thrdpool_t *pool, size_t begin, size_t end,
+                             size_t grain, void *result, size_t size,
+                             void (*init)(void *acc, void *context),
+                             void (*fn)(size_t begin, size_t end, void *acc,
+                                        void *context),
+                             void (*join)(void *acc, const void *other,
+                                          void *context),
+                             void *context);
+/* Timers, on a wheel with a tick of 1ms served by one thread per pool,
+ * started with the first timer. The task is scheduled no sooner than ms
+ * milliseconds from now; thrdpool_schedule_every() repeats it every ms
+ * after that, skipping runs while the last one is still queued. If timer
+ * is not NULL it receives a handle, valid until it is passed to
+ * thrdpool_timer_cancel(), which has to happen before the pool is
+ * destroyed. Timers not yet due at thrdpool_destory() are dropped. */
+int thrdpool_schedule_after(const struct thrdpool_task *task, long long ms,
+                            thrdpool_timer_t **timer, thrdpool_t *pool);
+int thrdpool_schedule_every(const struct thrdpool_task *task, long long ms,
+                            thrdpool_timer_t **timer, thrdpool_t *pool);
+/* Stop the timer and release the handle. Returns 1 if that kept a run
+ * from starting, 0 if nothing was left to stop. A run already started is
+ * not waited for. */
+int thrdpool_timer_cancel(thrdpool_timer_t *timer);
 int thrdpool_in_pool(thrdpool_t *pool);
+/* Lock-free snapshot; counters keep moving while it is taken. */
+void thrdpool_get_stats(struct thrdpool_stats *stats, thrdpool_t *pool);
+/* Lower bound of the bucket holding quantile q (0..1) of a histogram. */
+unsigned long long thrdpool_hist_percentile(
+    const unsigned long long hist[THRDPOOL_HIST_BUCKETS], double q);
+/* Stop and free the pool. Workers finish the task they are running and
+ * exit together; queued tasks go to pending, if not NULL. With
+ * THRDPOOL_SHUTDOWN_DRAIN, workers first run everything queued, including
+ * what those tasks schedule, for up to ms milliseconds (no limit if ms is
+ * negative). Returns 1 if that deadline passed, else 0. Timers stop at
+ * once either way. */
+int thrdpool_shutdown(void (*pending)(const struct thrdpool_task *),
+                      int mode, long long ms, thrdpool_t *pool);
+/* thrdpool_shutdown() with THRDPOOL_SHUTDOWN_ABANDON. */
 void thrdpool_destory(
     void (*pending)(const struct thrdpool_task *), thrdpool_t *pool);
 
+/* Sharded scheduling: nshards pools, each made from params with its own
+ * nthreads and, if params->cpus is set, its own slice of the cpus. Keys
+ * map to shards by consistent hashing, for cache affinity. Shards sit on
+ * a ring, and a shard with idle workers pulls queued tasks from a
+ * neighbour whose workers are all busy. The pools may be used with any
+ * call above except thrdpool_destory(); thrdpool_shards_destory() must
+ * not be called from one of their workers. */
+thrdpool_shards_t *thrdpool_shards_create(size_t nshards,
+                                          const struct thrdpool_params *params);
+thrdpool_t *thrdpool_shard_of(unsigned long long key,
+                              thrdpool_shards_t *shards);
+int thrdpool_schedule_keyed(unsigned long long key,
+                            const struct thrdpool_task *task,
+                            thrdpool_shards_t *shards);
+size_t thrdpool_shards_count(thrdpool_shards_t *shards);
+thrdpool_t *thrdpool_shards_get(size_t index, thrdpool_shards_t *shards);
+void thrdpool_shards_destory(void (*pending)(const struct thrdpool_task *),
+                             thrdpool_shards_t *shards);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,186 @@
+#include "timerwheel.h"
+#include <stdlib.h>
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_LEVELS 4
+// Further out than the top level reaches; parked there and cascaded again.
+#define TIMERWHEEL_SPAN (1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+struct __timerwheel
+{
+    unsigned long long current;
+    size_t count[TIMERWHEEL_LEVELS];
+    struct timerwheel_node* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+};
+
+timerwheel_t* timerwheel_create(unsigned long long now)
+{
+    timerwheel_t* wheel = (timerwheel_t*)calloc(1, sizeof(timerwheel_t));
+
+    if (wheel)
+        wheel->current = now;
+
+    return wheel;
+}
+
+/* base is the first tick still to be processed. Level l holds nodes due
+ * before base + 64^(l+1), in the slot of their tick's l-th digit, which
+ * the wheel reaches before or as the node is due. */
+static void __timerwheel_insert(struct timerwheel_node* node,
+                                unsigned long long base, timerwheel_t* wheel)
+{
+    unsigned long long at = node->expire > base ? node->expire : base;
+    struct timerwheel_node** slot;
+    int level = 0;
+
+    if (at - base >= TIMERWHEEL_SPAN)
+        at = base + TIMERWHEEL_SPAN - 1;
+
+    while (at - base >= 1ULL << (TIMERWHEEL_BITS * (level + 1)))
+        level++;
+
+    slot = &wheel->slots[level][(at >> (TIMERWHEEL_BITS * level)) &
+                                TIMERWHEEL_MASK];
+    node->level = level;
+    node->next = *slot;
+    if (node->next)
+        node->next->pprev = &node->next;
+
+    node->pprev = slot;
+    *slot = node;
+    wheel->count[level]++;
+}
+
+void timerwheel_add(struct timerwheel_node* node, unsigned long long expire,
+                    timerwheel_t* wheel)
+{
+    node->expire = expire;
+    __timerwheel_insert(node, wheel->current + 1, wheel);
+}
+
+void timerwheel_remove(struct timerwheel_node* node, timerwheel_t* wheel)
+{
+    *node->pprev = node->next;
+    if (node->next)
+        node->next->pprev = node->pprev;
+
+    wheel->count[node->level]--;
+}
+
+static struct timerwheel_node* __timerwheel_take(int level, int index,
+                                                 timerwheel_t* wheel)
+{
+    struct timerwheel_node* list = wheel->slots[level][index];
+    struct timerwheel_node* node;
+
+    wheel->slots[level][index] = NULL;
+    for (node = list; node; node = node->next)
+        wheel->count[level]--;
+
+    return list;
+}
+
+static size_t __timerwheel_upper(timerwheel_t* wheel)
+{
+    size_t n = 0;
+    int level;
+
+    for (level = 1; level < TIMERWHEEL_LEVELS; level++)
+        n += wheel->count[level];
+
+    return n;
+}
+
+struct timerwheel_node* timerwheel_advance(unsigned long long now,
+                                           timerwheel_t* wheel)
+{
+    struct timerwheel_node* expired = NULL;
+    struct timerwheel_node* node;
+    struct timerwheel_node* next;
+    unsigned long long t;
+    int level;
+
+    while (wheel->current < now)
+    {
+        if (wheel->count[0] == 0 && __timerwheel_upper(wheel) == 0)
+        {
+            wheel->current = now;
+            break;
+        }
+
+        t = ++wheel->current;
+        for (level = 1; level < TIMERWHEEL_LEVELS; level++)
+        {
+            if ((t >> (TIMERWHEEL_BITS * (level - 1))) & TIMERWHEEL_MASK)
+                break;
+
+            node = __timerwheel_take(level, (t >> (TIMERWHEEL_BITS * level)) &
+                                            TIMERWHEEL_MASK, wheel);
+            for (; node; node = next)
+            {
+                next = node->next;
+                __timerwheel_insert(node, t, wheel);
+            }
+        }
+
+        node = __timerwheel_take(0, t & TIMERWHEEL_MASK, wheel);
+        for (; node; node = next)
+        {
+            next = node->next;
+            node->next = expired;
+            expired = node;
+        }
+    }
+
+    return expired;
+}
+
+unsigned long long timerwheel_next(timerwheel_t* wheel)
+{
+    size_t upper = __timerwheel_upper(wheel);
+    unsigned long long t;
+
+    if (wheel->count[0] == 0 && upper == 0)
+        return 0;
+
+    for (t = wheel->current + 1; ; t++)
+    {
+        if ((t & TIMERWHEEL_MASK) == 0 && upper > 0)
+            return t;
+
+        if (wheel->slots[0][t & TIMERWHEEL_MASK])
+            return t;
+    }
+}
+
+struct timerwheel_node* timerwheel_drain(timerwheel_t* wheel)
+{
+    struct timerwheel_node* list = NULL;
+    struct timerwheel_node* node;
+    struct timerwheel_node* next;
+    int level;
+    int i;
+
+    for (level = 0; level < TIMERWHEEL_LEVELS; level++)
+    {
+        for (i = 0; i < TIMERWHEEL_SLOTS; i++)
+        {
+            node = __timerwheel_take(level, i, wheel);
+            for (; node; node = next)
+            {
+                next = node->next;
+                node->next = list;
+                list = node;
+            }
+        }
+    }
+
+    return list;
+}
+
+void timerwheel_destory(timerwheel_t* wheel)
+{
+    free(wheel);
+}
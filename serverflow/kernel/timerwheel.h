@@ -0,0 +1,42 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+/* Hierarchical timer wheel over abstract ticks: 64-slot levels, each tick
+ * of a level worth a full turn of the one below. Nodes are intrusive and
+ * add/remove are O(1); expiry is processed a tick at a time, cascading a
+ * higher level slot down every 64 ticks. Not thread safe. */
+
+typedef struct __timerwheel timerwheel_t;
+
+struct timerwheel_node {
+    struct timerwheel_node *next;
+    struct timerwheel_node **pprev;
+    unsigned long long expire;
+    int level;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Ticks up to and including now count as processed. */
+timerwheel_t *timerwheel_create(unsigned long long now);
+/* An expire at or before the current tick fires on the next advance. */
+void timerwheel_add(struct timerwheel_node *node, unsigned long long expire,
+                    timerwheel_t *wheel);
+void timerwheel_remove(struct timerwheel_node *node, timerwheel_t *wheel);
+/* Process every tick up to now. Returns the expired nodes, already
+ * removed, as a list linked through next. */
+struct timerwheel_node *timerwheel_advance(unsigned long long now,
+                                           timerwheel_t *wheel);
+/* The tick the wheel next needs advancing to, or 0 if it is empty. */
+unsigned long long timerwheel_next(timerwheel_t *wheel);
+/* Remove every node, returned as by timerwheel_advance(). */
+struct timerwheel_node *timerwheel_drain(timerwheel_t *wheel);
+void timerwheel_destory(timerwheel_t *wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
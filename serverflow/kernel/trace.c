@@ -0,0 +1,225 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_MASK (TRACE_RING_SIZE - 1)
+
+struct __trace_record
+{
+    unsigned long long tsc;
+    unsigned long long obj;
+    unsigned long long val;
+    unsigned int tid;
+    unsigned int event;
+};
+
+/* Written only by the thread that owns it. An exiting thread gives its
+ * ring up, records and all, to the next thread that needs one; records
+ * carry their own tid. */
+struct __trace_ring
+{
+    struct __trace_record recs[TRACE_RING_SIZE];
+    unsigned long long pos;
+    int owned;
+    struct __trace_ring* next;
+};
+
+static pthread_mutex_t __trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t __trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __trace_key;
+static int __trace_key_ok;
+static struct __trace_ring* __trace_rings;
+static unsigned long long __trace_tsc0;
+static unsigned long long __trace_ns0;
+
+static __thread struct __trace_ring* __trace_ring;
+static __thread unsigned int __trace_tid;
+
+static unsigned long long __trace_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long __trace_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long v;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return __trace_ns();
+#endif
+}
+
+static void __trace_exit(void* arg)
+{
+    struct __trace_ring* ring = (struct __trace_ring*)arg;
+
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void __trace_init(void)
+{
+    __trace_tsc0 = __trace_tsc();
+    __trace_ns0 = __trace_ns();
+    __trace_key_ok = pthread_key_create(&__trace_key, __trace_exit) == 0;
+}
+
+static struct __trace_ring* __trace_acquire(void)
+{
+    struct __trace_ring* ring;
+
+    pthread_once(&__trace_once, __trace_init);
+    pthread_mutex_lock(&__trace_mutex);
+    for (ring = __trace_rings; ring; ring = ring->next)
+    {
+        if (!__atomic_load_n(&ring->owned, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    if (!ring)
+    {
+        ring = (struct __trace_ring*)malloc(sizeof(struct __trace_ring));
+        if (ring)
+        {
+            ring->pos = 0;
+            ring->next = __trace_rings;
+            __trace_rings = ring;
+        }
+    }
+
+    if (ring)
+    {
+        ring->owned = 1;
+        if (__trace_key_ok)
+            pthread_setspecific(__trace_key, ring);
+    }
+
+    pthread_mutex_unlock(&__trace_mutex);
+    __trace_tid = (unsigned int)syscall(SYS_gettid);
+    return ring;
+}
+
+void trace_record(int event, const void* obj, unsigned long long val)
+{
+    struct __trace_ring* ring = __trace_ring;
+    struct __trace_record* rec;
+    unsigned long long pos;
+
+    if (!ring)
+    {
+        ring = __trace_acquire();
+        if (!ring)
+            return;
+
+        __trace_ring = ring;
+    }
+
+    pos = ring->pos;
+    rec = &ring->recs[pos & TRACE_MASK];
+    rec->tsc = __trace_tsc();
+    rec->obj = (unsigned long long)(size_t)obj;
+    rec->val = val;
+    rec->tid = __trace_tid;
+    rec->event = (unsigned int)event;
+    __atomic_store_n(&ring->pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+static const char* const __trace_names[] = {
+    NULL, "enqueue", "dequeue", "swap", "swap", "park", "park", "wake",
+    "task", "task",
+};
+
+// Chrome's phase letter: B/E pairs become slices, the rest instants.
+static const char __trace_phases[] = "?iiBEBEiBE";
+
+static int __trace_write(FILE* fp, double scale)
+{
+    const struct __trace_record* rec;
+    struct __trace_ring* ring;
+    unsigned long long first;
+    unsigned long long pos;
+    unsigned long long i;
+    const char* sep = "";
+    int pid = (int)getpid();
+
+    fprintf(fp, "{\"traceEvents\":[");
+    for (ring = __trace_rings; ring; ring = ring->next)
+    {
+        pos = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+        first = pos > TRACE_RING_SIZE ? pos - TRACE_RING_SIZE : 0;
+        for (i = first; i < pos; i++)
+        {
+            rec = &ring->recs[i & TRACE_MASK];
+            if (rec->event == 0 || rec->event > TRACE_TASK_END)
+                continue;
+
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                        "\"pid\":%d,\"tid\":%u,%s"
+                        "\"args\":{\"obj\":\"%#llx\",\"val\":%llu}}",
+                    sep, __trace_names[rec->event],
+                    __trace_phases[rec->event],
+                    (double)(rec->tsc - __trace_tsc0) * scale / 1000.0,
+                    pid, rec->tid,
+                    __trace_phases[rec->event] == 'i' ? "\"s\":\"t\"," : "",
+                    rec->obj, rec->val);
+            sep = ",";
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+    return ferror(fp) ? -1 : 0;
+}
+
+int trace_export(const char* path)
+{
+    unsigned long long tsc;
+    unsigned long long ns;
+    double scale = 1.0;
+    FILE* fp;
+    int ret;
+
+    pthread_once(&__trace_once, __trace_init);
+    tsc = __trace_tsc();
+    ns = __trace_ns();
+    // Cycles to nanoseconds, measured over the span since tracing began.
+    if (tsc > __trace_tsc0 && ns > __trace_ns0)
+        scale = (double)(ns - __trace_ns0) / (double)(tsc - __trace_tsc0);
+
+    fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    pthread_mutex_lock(&__trace_mutex);
+    ret = __trace_write(fp, scale);
+    pthread_mutex_unlock(&__trace_mutex);
+    if (fclose(fp) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+void trace_clear(void)
+{
+    struct __trace_ring* ring;
+
+    pthread_mutex_lock(&__trace_mutex);
+    for (ring = __trace_rings; ring; ring = ring->next)
+        __atomic_store_n(&ring->pos, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&__trace_mutex);
+}
@@ -0,0 +1,50 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+
+/* Trace points for msgqueue and thrdpool. Built with -DSERVERFLOW_TRACE,
+ * each point writes a fixed-size record with a cycle counter timestamp to
+ * a ring buffer of the calling thread's own; without it the points
+ * compile to nothing. A full ring overwrites its oldest records. The
+ * rings can be written out as a Chrome trace (chrome://tracing, Perfetto)
+ * with trace_export(). */
+
+#define TRACE_ENQUEUE 1     // obj queue, val messages
+#define TRACE_DEQUEUE 2     // obj queue, val messages
+#define TRACE_SWAP_BEGIN 3  // obj queue; a consumer takes the put list
+#define TRACE_SWAP_END 4    // obj queue, val messages taken
+#define TRACE_PARK_BEGIN 5  // obj queue or pool
+#define TRACE_PARK_END 6
+#define TRACE_WAKE 7        // obj queue or pool, val threads woken
+#define TRACE_TASK_BEGIN 8  // obj routine
+#define TRACE_TASK_END 9
+
+/* Records per thread, a power of two. */
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 16384
+#endif
+
+#ifdef SERVERFLOW_TRACE
+#define TRACE_POINT(event, obj, val) \
+    trace_record(event, (const void *)(obj), (unsigned long long)(val))
+#else
+#define TRACE_POINT(event, obj, val) ((void)0)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void trace_record(int event, const void *obj, unsigned long long val);
+/* Best taken while the traced threads are quiet: records being written
+ * meanwhile may come out torn. Returns -1 with errno on I/O failure. */
+int trace_export(const char *path);
+/* Forget every record so far. Same caveat as trace_export(). */
+void trace_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+#include "wsdeque.h"
+#include <stdlib.h>
+
+#define WSDEQUE_CACHELINE 64
+
+// Thieves CAS top while the owner moves bottom; keep them apart.
+struct __wsdeque
+{
+    long top __attribute__((aligned(WSDEQUE_CACHELINE)));
+    long bottom __attribute__((aligned(WSDEQUE_CACHELINE)));
+    long mask;
+    void** buf;
+};
+
+wsdeque_t* wsdeque_create(size_t capacity)
+{
+    wsdeque_t* deque;
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    if (posix_memalign((void**)&deque, WSDEQUE_CACHELINE,
+                       sizeof(wsdeque_t)) != 0)
+        deque = NULL;
+
+    if (deque)
+    {
+        deque->buf = (void**)malloc(size * sizeof(void*));
+        if (deque->buf)
+        {
+            deque->top = 0;
+            deque->bottom = 0;
+            deque->mask = (long)size - 1;
+            return deque;
+        }
+
+        free(deque);
+    }
+
+    return NULL;
+}
+
+int wsdeque_push(void* item, wsdeque_t* deque)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (b - t > deque->mask)
+        return -1;
+
+    __atomic_store_n(&deque->buf[b & deque->mask], item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void* wsdeque_pop(wsdeque_t* deque)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    void* item;
+
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (t > b)
+    {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    item = __atomic_load_n(&deque->buf[b & deque->mask], __ATOMIC_RELAXED);
+    if (t == b)
+    {
+        // Last item: race against thieves for it.
+        if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            item = NULL;
+        }
+
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+void* wsdeque_steal(wsdeque_t* deque)
+{
+    long t;
+    long b;
+    void* item;
+
+    while (1)
+    {
+        t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b)
+            return NULL;
+
+        item = __atomic_load_n(&deque->buf[t & deque->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            return item;
+        }
+    }
+}
+
+size_t wsdeque_size(wsdeque_t* deque)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    return b > t ? (size_t)(b - t) : 0;
+}
+
+void wsdeque_destory(wsdeque_t* deque)
+{
+    free(deque->buf);
+    free(deque);
+}
@@ -0,0 +1,33 @@
+#ifndef _WSDEQUE_H_
+#define _WSDEQUE_H_
+
+#include <stddef.h>
+
+/* Chase-Lev work-stealing deque of fixed capacity. The owner thread pushes
+ * and pops at the bottom (LIFO); any other thread may steal from the top
+ * (FIFO). */
+
+typedef struct __wsdeque wsdeque_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+wsdeque_t *wsdeque_create(size_t capacity);
+/* Owner only. Returns -1 if the deque is full. */
+int wsdeque_push(void *item, wsdeque_t *deque);
+/* Owner only. Returns NULL if the deque is empty. */
+void *wsdeque_pop(wsdeque_t *deque);
+/* Any thread. Retries lost races; returns NULL only if it saw the deque
+ * empty. */
+void *wsdeque_steal(wsdeque_t *deque);
+/* Any thread. A snapshot; from the owner it never misses an item, though
+ * it may still count one a thief is taking. */
+size_t wsdeque_size(wsdeque_t *deque);
+void wsdeque_destory(wsdeque_t *deque);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,653 @@
+/* Smoke coverage for the kernel features that have no test of their own:
+ * timers, cancel handles, task groups, deadline tasks, serial queues,
+ * coroutines, the SPSC ring and flows. Each case runs the feature once,
+ * the plain way, and checks that it did what the header says. */
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "flow.h"
+#include "spscring.h"
+#include "thrdpool.h"
+#include "timerwheel.h"
+
+static int __gate;
+static int __held;
+static int __count;
+
+static unsigned long long test_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static thrdpool_t* test_pool(size_t nthreads)
+{
+    struct thrdpool_params params = THRDPOOL_PARAMS_DEFAULT;
+
+    params.nthreads = nthreads;
+    params.stats = 1;
+    return thrdpool_create_ex(&params);
+}
+
+// Wait for *p to reach n, for a second at most.
+static int test_wait(int* p, int n)
+{
+    unsigned long long start = test_now();
+
+    while (__atomic_load_n(p, __ATOMIC_ACQUIRE) < n)
+    {
+        if (test_now() - start > 1000000000ULL)
+            return 0;
+
+        usleep(1000);
+    }
+
+    return 1;
+}
+
+static void test_count(void* context)
+{
+    (void)context;
+    __atomic_add_fetch(&__count, 1, __ATOMIC_RELEASE);
+}
+
+// Holds a worker until __gate opens, so later tasks stay queued.
+static void test_block(void* context)
+{
+    (void)context;
+    __atomic_store_n(&__held, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&__gate, __ATOMIC_ACQUIRE))
+        usleep(100);
+}
+
+static void test_hold(thrdpool_t* pool)
+{
+    struct thrdpool_task task = {
+        .routine = test_block,
+        .context = NULL,
+    };
+
+    __gate = 0;
+    __held = 0;
+    thrdpool_schedule(&task, pool);
+    test_wait(&__held, 1);
+}
+
+static int test_timerwheel(void)
+{
+    timerwheel_t* wheel = timerwheel_create(0);
+    struct timerwheel_node nodes[3];
+    struct timerwheel_node* node;
+    int fired = 0;
+
+    if (!wheel)
+        return 0;
+
+    timerwheel_add(&nodes[0], 5, wheel);
+    timerwheel_add(&nodes[1], 100, wheel); // past the first level
+    timerwheel_add(&nodes[2], 7, wheel);
+    timerwheel_remove(&nodes[2], wheel);
+    for (node = timerwheel_advance(4, wheel); node; node = node->next)
+        fired++;
+
+    if (fired != 0 || timerwheel_next(wheel) == 0)
+        return 0;
+
+    for (node = timerwheel_advance(100, wheel); node; node = node->next)
+        fired++;
+
+    if (fired != 2 || timerwheel_next(wheel) != 0)
+        return 0;
+
+    timerwheel_destory(wheel);
+    return 1;
+}
+
+static int test_timers(void)
+{
+    thrdpool_t* pool = test_pool(2);
+    struct thrdpool_task task = {
+        .routine = test_count,
+        .context = NULL,
+    };
+    thrdpool_timer_t* timer;
+    int seen;
+    int ok;
+
+    if (!pool)
+        return 0;
+
+    __count = 0;
+    ok = thrdpool_schedule_after(&task, 10, NULL, pool) == 0 &&
+         test_wait(&__count, 1);
+
+    // Repeats until canceled, and not after.
+    __count = 0;
+    if (ok && thrdpool_schedule_every(&task, 2, &timer, pool) == 0)
+    {
+        ok = test_wait(&__count, 3);
+        thrdpool_timer_cancel(timer);
+        usleep(10000);
+        seen = __atomic_load_n(&__count, __ATOMIC_ACQUIRE);
+        usleep(20000);
+        ok = ok && __atomic_load_n(&__count, __ATOMIC_ACQUIRE) == seen;
+    }
+    else
+        ok = 0;
+
+    // One not yet due is canceled before it runs.
+    __count = 0;
+    if (ok && thrdpool_schedule_after(&task, 1000, &timer, pool) == 0)
+        ok = thrdpool_timer_cancel(timer) == 1 && __count == 0;
+    else
+        ok = 0;
+
+    thrdpool_destory(NULL, pool);
+    return ok;
+}
+
+static thrdpool_t* __stats_pool;
+static unsigned long long __stats_tasks;
+static unsigned long long __stats_runs;
+static int __stats_done;
+
+// Run last on a single worker, so every task before it is accounted.
+static void test_take_stats(void* context)
+{
+    struct thrdpool_stats stats;
+    int i;
+
+    (void)context;
+    thrdpool_get_stats(&stats, __stats_pool);
+    __stats_tasks = stats.tasks;
+    __stats_runs = 0;
+    for (i = 0; i < THRDPOOL_HIST_BUCKETS; i++)
+        __stats_runs += stats.run_hist[i];
+
+    __atomic_store_n(&__stats_done, 1, __ATOMIC_RELEASE);
+}
+
+static int test_cancel(void)
+{
+    thrdpool_t* pool = test_pool(1);
+    struct thrdpool_task task = {
+        .routine = test_count,
+        .context = NULL,
+    };
+    struct thrdpool_task last = {
+        .routine = test_take_stats,
+        .context = NULL,
+    };
+    thrdpool_handle_t* queued;
+    thrdpool_handle_t* done;
+    int ok;
+
+    if (!pool)
+        return 0;
+
+    __count = 0;
+    __stats_pool = pool;
+    __stats_done = 0;
+    test_hold(pool);
+    if (thrdpool_schedule_cancelable(&task, &queued, pool) < 0)
+        return 0;
+
+    if (thrdpool_schedule_cancelable(&task, &done, pool) < 0)
+        return 0;
+
+    ok = thrdpool_cancel(queued) == 1;
+    thrdpool_schedule(&last, pool);
+    __atomic_store_n(&__gate, 1, __ATOMIC_RELEASE);
+    ok = ok && test_wait(&__count, 1) && test_wait(&__stats_done, 1);
+
+    // The hold and the one that ran, but not the canceled one.
+    ok = ok && __stats_tasks == 2 && __stats_runs == 2;
+
+    // Too late for the one that ran, and the canceled one stays skipped.
+    ok = ok && thrdpool_cancel(done) == 0;
+    thrdpool_shutdown(NULL, THRDPOOL_SHUTDOWN_DRAIN, -1, pool);
+    thrdpool_handle_release(queued);
+    thrdpool_handle_release(done);
+    return ok && __count == 1;
+}
+
+static thrdpool_group_t* __group;
+
+static void test_fan_out(void* context)
+{
+    struct thrdpool_task task = {
+        .routine = test_count,
+        .context = NULL,
+    };
+    int i;
+
+    (void)context;
+    for (i = 0; i < 10; i++)
+        thrdpool_group_schedule(&task, __group);
+
+    test_count(NULL);
+}
+
+static int __group_done;
+
+static void test_group_done(void* context)
+{
+    (void)context;
+    __atomic_store_n(&__group_done, 1, __ATOMIC_RELEASE);
+}
+
+static int test_groups(void)
+{
+    thrdpool_t* pool = test_pool(4);
+    struct thrdpool_task task = {
+        .routine = test_fan_out,
+        .context = NULL,
+    };
+    struct thrdpool_task done = {
+        .routine = test_group_done,
+        .context = NULL,
+    };
+    int ok = 1;
+    int round;
+    int i;
+
+    if (!pool)
+        return 0;
+
+    __group = thrdpool_group_create(&done, pool);
+    if (!__group)
+        return 0;
+
+    // The group's own tasks add to it, and it can be waited on again.
+    for (round = 0; round < 2; round++)
+    {
+        __count = 0;
+        __group_done = 0;
+        for (i = 0; i < 10; i++)
+            thrdpool_group_schedule(&task, __group);
+
+        thrdpool_group_wait(__group);
+        ok = ok && __atomic_load_n(&__count, __ATOMIC_ACQUIRE) == 110;
+        ok = ok && test_wait(&__group_done, 1);
+    }
+
+    __count = 0;
+    __group_done = 0;
+    thrdpool_group_schedule(&task, __group);
+    thrdpool_group_close(__group);
+    ok = ok && test_wait(&__group_done, 1) && __count == 11;
+    thrdpool_shutdown(NULL, THRDPOOL_SHUTDOWN_DRAIN, -1, pool);
+    thrdpool_group_destory(__group);
+    return ok;
+}
+
+static int __order[8];
+
+static void test_record(void* context)
+{
+    int n = __atomic_fetch_add(&__count, 1, __ATOMIC_ACQ_REL);
+
+    __order[n] = (int)(size_t)context;
+}
+
+static int test_deadlines(void)
+{
+    thrdpool_t* pool = test_pool(1);
+    struct thrdpool_task task = {
+        .routine = test_record,
+        .context = NULL,
+    };
+    unsigned long long deadline = test_now() + 10000000000ULL;
+    int ok = 1;
+    int i;
+
+    if (!pool)
+        return 0;
+
+    // Queued in reverse behind a held worker; they run by deadline.
+    __count = 0;
+    test_hold(pool);
+    for (i = 7; i >= 0; i--)
+    {
+        task.context = (void*)(size_t)i;
+        if (thrdpool_schedule_deadline(&task, deadline + i, pool) < 0)
+            ok = 0;
+    }
+
+    __atomic_store_n(&__gate, 1, __ATOMIC_RELEASE);
+    thrdpool_shutdown(NULL, THRDPOOL_SHUTDOWN_DRAIN, -1, pool);
+    if (__count != 8)
+        return 0;
+
+    for (i = 0; i < 8; i++)
+    {
+        if (__order[i] != i)
+            ok = 0;
+    }
+
+    return ok;
+}
+
+#define TEST_SERIALS 4
+#define TEST_SUBMITTERS 4
+#define TEST_SERIAL_TASKS 2000
+
+struct test_serial
+{
+    thrdpool_serial_t* serial;
+    int last[TEST_SUBMITTERS]; // written only by the serial queue's tasks
+    int busy;
+    int bad;
+};
+
+struct test_serial_task
+{
+    struct test_serial* ts;
+    int submitter;
+    int seq;
+};
+
+static struct test_serial __serials[TEST_SERIALS];
+static struct test_serial_task
+    __serial_tasks[TEST_SUBMITTERS][TEST_SERIAL_TASKS][TEST_SERIALS];
+static int __serial_failed;
+
+// Tasks of one submitter must run one at a time and in its order.
+static void test_serial_step(void* context)
+{
+    struct test_serial_task* st = (struct test_serial_task*)context;
+    struct test_serial* ts = st->ts;
+
+    if (__atomic_exchange_n(&ts->busy, 1, __ATOMIC_ACQUIRE))
+        ts->bad = 1;
+
+    if (ts->last[st->submitter] != st->seq - 1)
+        ts->bad = 1;
+
+    ts->last[st->submitter] = st->seq;
+    __atomic_store_n(&ts->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void* test_submit(void* arg)
+{
+    int submitter = (int)(size_t)arg;
+    struct test_serial_task* st;
+    struct thrdpool_task task = {
+        .routine = test_serial_step,
+        .context = NULL,
+    };
+    int i;
+    int j;
+
+    for (j = 0; j < TEST_SERIAL_TASKS; j++)
+    {
+        for (i = 0; i < TEST_SERIALS; i++)
+        {
+            st = &__serial_tasks[submitter][j][i];
+            st->ts = &__serials[i];
+            st->submitter = submitter;
+            st->seq = j;
+            task.context = st;
+            if (thrdpool_serial_schedule(&task, __serials[i].serial) < 0)
+                __serial_failed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+static int test_serials(void)
+{
+    thrdpool_t* pool = test_pool(4);
+    pthread_t tids[TEST_SUBMITTERS];
+    int ok = 1;
+    int i;
+    int j;
+
+    if (!pool)
+        return 0;
+
+    for (i = 0; i < TEST_SERIALS; i++)
+    {
+        __serials[i].serial = thrdpool_serial_create(pool);
+        if (!__serials[i].serial)
+            return 0;
+
+        for (j = 0; j < TEST_SUBMITTERS; j++)
+            __serials[i].last[j] = -1;
+
+        __serials[i].busy = 0;
+        __serials[i].bad = 0;
+    }
+
+    __serial_failed = 0;
+    for (j = 0; j < TEST_SUBMITTERS; j++)
+        pthread_create(&tids[j], NULL, test_submit, (void*)(size_t)j);
+
+    for (j = 0; j < TEST_SUBMITTERS; j++)
+        pthread_join(tids[j], NULL);
+
+    thrdpool_shutdown(NULL, THRDPOOL_SHUTDOWN_DRAIN, -1, pool);
+    ok = !__serial_failed;
+    for (i = 0; i < TEST_SERIALS; i++)
+    {
+        if (__serials[i].bad)
+            ok = 0;
+
+        for (j = 0; j < TEST_SUBMITTERS; j++)
+        {
+            if (__serials[i].last[j] != TEST_SERIAL_TASKS - 1)
+                ok = 0;
+        }
+
+        thrdpool_serial_destory(__serials[i].serial);
+    }
+
+    return ok;
+}
+
+static thrdpool_coroutine_t* __self;
+static int __parked;
+static int __finished;
+
+static void test_coro(void* context)
+{
+    int i;
+
+    (void)context;
+    for (i = 0; i < 3; i++)
+        thrdpool_yield();
+
+    __self = thrdpool_coroutine_self();
+    __atomic_store_n(&__parked, 1, __ATOMIC_RELEASE);
+    thrdpool_suspend();
+    __atomic_store_n(&__finished, 1, __ATOMIC_RELEASE);
+}
+
+static int test_coroutines(void)
+{
+    thrdpool_t* pool = test_pool(2);
+    struct thrdpool_task task = {
+        .routine = test_coro,
+        .context = NULL,
+    };
+    int ok;
+
+    if (!pool)
+        return 0;
+
+    __parked = 0;
+    __finished = 0;
+    ok = thrdpool_yield() < 0 && thrdpool_coroutine_self() == NULL;
+    if (thrdpool_schedule_coroutine(&task, pool) < 0)
+        return 0;
+
+    ok = ok && test_wait(&__parked, 1) && !__finished;
+    thrdpool_resume(__self);
+    ok = ok && test_wait(&__finished, 1);
+    thrdpool_destory(NULL, pool);
+    return ok;
+}
+
+// Runs on the coroutine's own stack, which the pool must not free under it.
+static void test_coro_destroy(void* context)
+{
+    thrdpool_destory(NULL, (thrdpool_t*)context);
+    __atomic_store_n(&__finished, 1, __ATOMIC_RELEASE);
+}
+
+static int test_coroutine_destroy(void)
+{
+    thrdpool_t* pool = test_pool(2);
+    struct thrdpool_task task = {
+        .routine = test_coro_destroy,
+        .context = pool,
+    };
+
+    if (!pool)
+        return 0;
+
+    __finished = 0;
+    if (thrdpool_schedule_coroutine(&task, pool) < 0)
+        return 0;
+
+    // Let the worker finish tearing down and free the pool.
+    if (!test_wait(&__finished, 1))
+        return 0;
+
+    usleep(20000);
+    return 1;
+}
+
+#define TEST_RING_MSGS 200000
+
+// A tiny ring with no spinning, so both sides park over and over.
+static void* test_ring_producer(void* arg)
+{
+    spscring_t* ring = (spscring_t*)arg;
+    size_t i;
+
+    for (i = 1; i <= TEST_RING_MSGS; i++)
+        spscring_put((void*)i, ring);
+
+    return NULL;
+}
+
+static int test_spscring(void)
+{
+    spscring_t* ring = spscring_create(4);
+    pthread_t tid;
+    int ok = 1;
+    size_t i;
+
+    if (!ring)
+        return 0;
+
+    pthread_create(&tid, NULL, test_ring_producer, ring);
+    for (i = 1; i <= TEST_RING_MSGS; i++)
+    {
+        if (spscring_get(ring) != (void*)i)
+            ok = 0;
+    }
+
+    pthread_join(tid, NULL);
+    ok = ok && spscring_size(ring) == 0 && spscring_try_get(ring) == NULL;
+    spscring_destory(ring);
+    return ok;
+}
+
+#define TEST_FLOW_MSGS 1000
+
+struct test_flow_msg
+{
+    void* link;
+    int hops;
+};
+
+static flow_stage_t* test_first(void* msg, void* context)
+{
+    ((struct test_flow_msg*)msg)->hops++;
+    return *(flow_stage_t**)context;
+}
+
+static flow_stage_t* test_last(void* msg, void* context)
+{
+    (void)context;
+    ((struct test_flow_msg*)msg)->hops++;
+    return NULL;
+}
+
+static int test_flow(void)
+{
+    static struct test_flow_msg msgs[TEST_FLOW_MSGS];
+    flow_t* flow = flow_create(offsetof(struct test_flow_msg, link));
+    flow_stage_t* first;
+    flow_stage_t* last;
+    int ok = 1;
+    int i;
+
+    if (!flow)
+        return 0;
+
+    // The small queue between the stages makes the first one wait.
+    last = flow_stage_create(test_last, NULL, 1, 4, flow);
+    first = flow_stage_create(test_first, &last, 2, 0, flow);
+    if (!first || !last)
+        return 0;
+
+    for (i = 0; i < TEST_FLOW_MSGS; i++)
+    {
+        msgs[i].hops = 0;
+        if (flow_put(&msgs[i], first) < 0)
+            ok = 0;
+    }
+
+    flow_wait(flow);
+    for (i = 0; i < TEST_FLOW_MSGS; i++)
+    {
+        if (msgs[i].hops != 2)
+            ok = 0;
+    }
+
+    flow_destory(flow);
+    return ok;
+}
+
+int main(void)
+{
+    static const struct
+    {
+        const char* name;
+        int (*run)(void);
+    } cases[] = {
+        { "timerwheel", test_timerwheel },
+        { "timers", test_timers },
+        { "cancel", test_cancel },
+        { "groups", test_groups },
+        { "deadlines", test_deadlines },
+        { "serials", test_serials },
+        { "coroutines", test_coroutines },
+        { "coroutine destroy", test_coroutine_destroy },
+        { "spscring", test_spscring },
+        { "flow", test_flow },
+    };
+    int failed = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+    {
+        if (cases[i].run())
+            printf("%s: ok\n", cases[i].name);
+        else
+        {
+            printf("%s: FAILED\n", cases[i].name);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,170 @@
+/* Bounded MSGQUEUE_LOCKFREE queues under many producers and consumers:
+ * every overload policy must keep msgqueue_size() within maxlen, deliver
+ * or drop each message exactly once, and finish. */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "msgqueue.h"
+
+#define TEST_PRODUCERS 8
+#define TEST_CONSUMERS 2
+#define TEST_PER_PRODUCER 20000
+
+struct test_msg
+{
+    void* link;
+    size_t id;
+};
+
+struct test_queue
+{
+    msgqueue_t* queue;
+    int policy;
+    struct test_msg* msgs;
+    unsigned char* seen;
+    size_t worst;
+    size_t done;
+};
+
+static void test_mark(size_t size, struct test_queue* tq)
+{
+    size_t worst = __atomic_load_n(&tq->worst, __ATOMIC_RELAXED);
+
+    while (size > worst &&
+           !__atomic_compare_exchange_n(&tq->worst, &worst, size, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+static void test_seen(struct test_msg* msg, struct test_queue* tq)
+{
+    __atomic_add_fetch(&tq->seen[msg->id], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tq->done, 1, __ATOMIC_RELEASE);
+}
+
+static void test_drop(void* msg, void* context)
+{
+    test_seen((struct test_msg*)msg, (struct test_queue*)context);
+}
+
+static int __next_producer;
+
+static void* test_producer(void* arg)
+{
+    struct test_queue* tq = (struct test_queue*)arg;
+    int index = __atomic_fetch_add(&__next_producer, 1, __ATOMIC_RELAXED);
+    struct test_msg* msg = tq->msgs + (size_t)index * TEST_PER_PRODUCER;
+    size_t i;
+
+    for (i = 0; i < TEST_PER_PRODUCER; i++)
+    {
+        if (tq->policy == MSGQUEUE_FAIL)
+        {
+            while (msgqueue_put(&msg[i], tq->queue) < 0)
+                sched_yield();
+        }
+        else
+            msgqueue_put(&msg[i], tq->queue);
+
+        test_mark(msgqueue_size(tq->queue), tq);
+    }
+
+    return NULL;
+}
+
+static void* test_consumer(void* arg)
+{
+    struct test_queue* tq = (struct test_queue*)arg;
+    struct test_msg* msg;
+
+    while ((msg = (struct test_msg*)msgqueue_get(tq->queue)) != NULL)
+    {
+        test_mark(msgqueue_size(tq->queue), tq);
+        test_seen(msg, tq);
+    }
+
+    return NULL;
+}
+
+static int test_run(int policy, size_t maxlen)
+{
+    size_t total = (size_t)TEST_PRODUCERS * TEST_PER_PRODUCER;
+    pthread_t producers[TEST_PRODUCERS];
+    pthread_t consumers[TEST_CONSUMERS];
+    struct test_queue tq;
+    size_t bad = 0;
+    size_t hwm;
+    size_t i;
+
+    tq.queue = msgqueue_create_ex(maxlen, 0, MSGQUEUE_LOCKFREE);
+    tq.msgs = (struct test_msg*)calloc(total, sizeof(struct test_msg));
+    tq.seen = (unsigned char*)calloc(total, 1);
+    if (!tq.queue || !tq.msgs || !tq.seen)
+    {
+        perror("test_run");
+        exit(1);
+    }
+
+    tq.policy = policy;
+    tq.worst = 0;
+    tq.done = 0;
+    for (i = 0; i < total; i++)
+        tq.msgs[i].id = i;
+
+    msgqueue_set_policy(tq.queue, policy, test_drop, &tq);
+    __next_producer = 0;
+    for (i = 0; i < TEST_CONSUMERS; i++)
+        pthread_create(&consumers[i], NULL, test_consumer, &tq);
+
+    for (i = 0; i < TEST_PRODUCERS; i++)
+        pthread_create(&producers[i], NULL, test_producer, &tq);
+
+    for (i = 0; i < TEST_PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+
+    while (__atomic_load_n(&tq.done, __ATOMIC_ACQUIRE) < total)
+        sched_yield();
+
+    msgqueue_set_nonblock(tq.queue);
+    for (i = 0; i < TEST_CONSUMERS; i++)
+        pthread_join(consumers[i], NULL);
+
+    for (i = 0; i < total; i++)
+    {
+        if (tq.seen[i] != 1)
+            bad++;
+    }
+
+    hwm = msgqueue_high_watermark(tq.queue);
+    printf("policy %d maxlen %zu: largest size %zu, high watermark %zu, "
+           "%zu not seen exactly once\n", policy, maxlen, tq.worst, hwm, bad);
+
+    msgqueue_destory(tq.queue);
+    free(tq.msgs);
+    free(tq.seen);
+    return tq.worst <= maxlen && hwm <= maxlen && bad == 0;
+}
+
+int main(void)
+{
+    static const int policies[] = {
+        MSGQUEUE_BLOCK, MSGQUEUE_FAIL, MSGQUEUE_DROP_OLDEST,
+    };
+    static const size_t maxlens[] = { 1, 2, 8 };
+    int failed = 0;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < sizeof(policies) / sizeof(*policies); i++)
+    {
+        for (j = 0; j < sizeof(maxlens) / sizeof(*maxlens); j++)
+        {
+            if (!test_run(policies[i], maxlens[j]))
+                failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,238 @@
+/* inline_depth with a work-stealing deque, on a single worker so that
+ * nothing runs behind the test's back:
+ *
+ * - a continuation is not run inline while the worker's own deque holds
+ *   a task it queued earlier, and is run inline once the deque is empty;
+ * - a task left in the run-next slot is served by a worker that helps in
+ *   thrdpool_group_wait(), ahead of the group's tasks;
+ * - a coroutine's continuation is queued, not run inline, so that one
+ *   parked inside it does not hold the worker's depth;
+ * - inline runs are in the wait and run histograms like any task. */
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "thrdpool.h"
+
+static thrdpool_t* __pool;
+static int __in_schedule; // the caller is inside thrdpool_schedule()
+static int __ran_inside; // how many tasks ran while it was
+static int __ran;
+static int __failed;
+static int __first_done;
+
+static void test_note(void* context)
+{
+    (void)context;
+    if (__in_schedule)
+        __ran_inside++;
+
+    __atomic_add_fetch(&__ran, 1, __ATOMIC_RELEASE);
+}
+
+static void test_schedule(void (*routine)(void*))
+{
+    struct thrdpool_task task = {
+        .routine = routine,
+        .context = NULL,
+    };
+
+    __in_schedule = 1;
+    thrdpool_schedule(&task, __pool);
+    __in_schedule = 0;
+}
+
+static void test_queued_first(void* context)
+{
+    struct thrdpool_task task = {
+        .routine = test_note,
+        .context = NULL,
+    };
+    thrdpool_group_t* group = thrdpool_group_create(NULL, __pool);
+
+    (void)context;
+    // Group tasks are never run inline; this one waits on the deque.
+    thrdpool_group_schedule(&task, group);
+    test_schedule(test_note);
+    if (__ran_inside != 0)
+    {
+        fprintf(stderr, "ran inline ahead of the deque\n");
+        __failed = 1;
+    }
+
+    thrdpool_group_wait(group);
+    thrdpool_group_destory(group);
+
+    // The deque is empty now, so this one does run inline.
+    test_schedule(test_note);
+    if (__ran_inside != 1)
+    {
+        fprintf(stderr, "did not run inline with an empty deque\n");
+        __failed = 1;
+    }
+
+    __atomic_store_n(&__first_done, 1, __ATOMIC_RELEASE);
+}
+
+static int __next_done;
+
+static void test_next(void* context)
+{
+    (void)context;
+    __atomic_store_n(&__next_done, 1, __ATOMIC_RELEASE);
+}
+
+static void test_after_next(void* context)
+{
+    struct timespec start;
+    struct timespec now;
+
+    (void)context;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        if (__atomic_load_n(&__next_done, __ATOMIC_ACQUIRE))
+            return;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < 1);
+
+    fprintf(stderr, "the run-next task waited for the group\n");
+    __failed = 1;
+}
+
+static void test_helping(void* context)
+{
+    struct thrdpool_task task = {
+        .routine = test_after_next,
+        .context = NULL,
+    };
+    thrdpool_group_t* group;
+
+    (void)context;
+    // At the depth cap: this lands in the run-next slot.
+    test_schedule(test_next);
+    group = thrdpool_group_create(NULL, __pool);
+    thrdpool_group_schedule(&task, group);
+    thrdpool_group_wait(group);
+    thrdpool_group_destory(group);
+}
+
+static void test_nested(void* context)
+{
+    (void)context;
+    test_schedule(test_helping);
+}
+
+static thrdpool_coroutine_t* __parked;
+static int __coro_done;
+
+static void test_in_coro(void* context)
+{
+    thrdpool_coroutine_t* self = thrdpool_coroutine_self();
+
+    (void)context;
+    if (self)
+    {
+        fprintf(stderr, "ran inline in a coroutine\n");
+        __failed = 1;
+        __atomic_store_n(&__parked, self, __ATOMIC_RELEASE);
+        thrdpool_suspend();
+    }
+
+    __atomic_store_n(&__coro_done, 1, __ATOMIC_RELEASE);
+}
+
+static void test_coro(void* context)
+{
+    (void)context;
+    test_schedule(test_in_coro);
+}
+
+static int __after_done;
+
+static void test_after_coro(void* context)
+{
+    int inside = __ran_inside;
+    struct thrdpool_stats stats;
+    unsigned long long waits = 0;
+    unsigned long long runs = 0;
+    int i;
+
+    (void)context;
+    test_schedule(test_note);
+    if (__ran_inside != inside + 1)
+    {
+        fprintf(stderr, "the coroutine kept the worker's depth\n");
+        __failed = 1;
+    }
+
+    // Every task counted is in both histograms; this one only waited yet.
+    thrdpool_get_stats(&stats, __pool);
+    for (i = 0; i < THRDPOOL_HIST_BUCKETS; i++)
+    {
+        waits += stats.wait_hist[i];
+        runs += stats.run_hist[i];
+    }
+
+    if (runs != stats.tasks || waits != stats.tasks + 1)
+    {
+        fprintf(stderr, "histograms hold %llu and %llu of %llu tasks\n",
+                waits, runs, stats.tasks);
+        __failed = 1;
+    }
+
+    __atomic_store_n(&__after_done, 1, __ATOMIC_RELEASE);
+}
+
+int main(void)
+{
+    struct thrdpool_params params = THRDPOOL_PARAMS_DEFAULT;
+    struct thrdpool_task task = {
+        .routine = test_queued_first,
+        .context = NULL,
+    };
+
+    params.nthreads = 1;
+    params.deque_size = 64;
+    params.inline_depth = 1;
+    params.stats = 1;
+    __pool = thrdpool_create_ex(&params);
+    if (!__pool)
+    {
+        perror("thrdpool_create_ex");
+        return 1;
+    }
+
+    // One at a time: a queued task would keep the control from inlining.
+    thrdpool_schedule(&task, __pool);
+    while (!__atomic_load_n(&__first_done, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    task.routine = test_coro;
+    thrdpool_schedule_coroutine(&task, __pool);
+    while (!__atomic_load_n(&__coro_done, __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&__parked, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    task.routine = test_after_coro;
+    thrdpool_schedule(&task, __pool);
+    while (!__atomic_load_n(&__after_done, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    if (__parked)
+        thrdpool_resume(__parked);
+
+    task.routine = test_nested;
+    thrdpool_schedule(&task, __pool);
+    thrdpool_shutdown(NULL, THRDPOOL_SHUTDOWN_DRAIN, -1, __pool);
+    if (__ran != 4 || !__next_done || !__coro_done)
+    {
+        fprintf(stderr, "%d of 4 tasks ran\n", __ran);
+        __failed = 1;
+    }
+
+    if (!__failed)
+        printf("ok\n");
+
+    return __failed;
+}
@@ -0,0 +1,77 @@
+/* thrdpool_decrease() on a shard whose workers are all busy, while its
+ * neighbour is idle: the neighbour pulls from the busy shard's lanes, and
+ * must leave the exit task to the shard it belongs to. */
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "thrdpool.h"
+
+#define TEST_ROUNDS 10
+
+static int __gate;
+static size_t __done;
+
+static void test_block(void* context)
+{
+    (void)context;
+    while (!__atomic_load_n(&__gate, __ATOMIC_ACQUIRE))
+        usleep(100);
+
+    __atomic_add_fetch(&__done, 1, __ATOMIC_RELEASE);
+}
+
+int main(void)
+{
+    struct thrdpool_params params = THRDPOOL_PARAMS_DEFAULT;
+    struct thrdpool_task task = {
+        .routine = test_block,
+        .context = NULL,
+    };
+    thrdpool_shards_t* shards;
+    thrdpool_t* pool;
+    int round;
+    size_t i;
+
+    params.nthreads = 2;
+    for (round = 0; round < TEST_ROUNDS; round++)
+    {
+        shards = thrdpool_shards_create(2, &params);
+        if (!shards)
+        {
+            perror("thrdpool_shards_create");
+            return 1;
+        }
+
+        pool = thrdpool_shards_get(0, shards);
+        __gate = 0;
+        __done = 0;
+        for (i = 0; i < params.nthreads; i++)
+            thrdpool_schedule(&task, pool);
+
+        // Both workers of shard 0 are held, so only shard 1 is idle.
+        usleep(20000);
+        if (thrdpool_decrease(pool) < 0)
+        {
+            perror("thrdpool_decrease");
+            return 1;
+        }
+
+        usleep(20000);
+        __atomic_store_n(&__gate, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&__done, __ATOMIC_ACQUIRE) < params.nthreads)
+            usleep(1000);
+
+        // Down to one worker, shard 0 refuses another decrease.
+        usleep(20000);
+        if (thrdpool_decrease(pool) == 0 || errno != EINVAL)
+        {
+            fprintf(stderr, "round %d: shard 0 kept both workers\n", round);
+            return 1;
+        }
+
+        thrdpool_shards_destory(NULL, shards);
+    }
+
+    printf("%d rounds ok\n", TEST_ROUNDS);
+    return 0;
+}